@@ -32,7 +32,12 @@
 
 #include <ros/callback_queue.h>
 #include <ros/callback_queue_interface.h>
-#include <boost/enable_shared_from_this.hpp>
+#include <ros/time.h>
+#include <boost/atomic.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/unordered_map.hpp>
 
 namespace ros
 {
@@ -46,13 +51,41 @@ namespace detail
 {
 
 class CallbackQueueManager;
+struct MemoryAccount;
 
-class CallbackQueue : public ros::CallbackQueueInterface,
-                      public boost::enable_shared_from_this<CallbackQueue>
+/**
+ * \brief Internal use
+ *
+ * Per-nodelet callback queue.  Callbacks are not executed by the thread adding them; instead
+ * CallbackQueueManager is told about each one and later calls callOne() from a worker thread.
+ * A queue without a parent manager is driven by calling callOne() directly.
+ *
+ * Pending callbacks are kept in an intrusive lock-free list.  addCallback() finds its owner id in a
+ * small lock-free cache, and only locks when the id isn't there (or when the queue is bounded and
+ * full).  Concurrent callOne() calls only serialize for the few instructions it takes to unlink the
+ * next node.  removeByID() doesn't search the list: it starts a new generation of the owner, and
+ * the callbacks of earlier generations are discarded when they come up.
+ *
+ * The queue does not track the lifetime of its nodelet.  Instead CallbackQueueManager::removeQueue()
+ * disables it and waits for the worker threads to pass a quiescent state, after which none of its
+ * callbacks are running or will run.
+ *
+ * The queue is unbounded by default.  setMaxSize() caps the number of pending callbacks, and the
+ * OverflowPolicy decides what happens to a callback added while the queue is full.
+ */
+class CallbackQueue : public ros::CallbackQueueInterface
 {
 public:
-  CallbackQueue(CallbackQueueManager* parent,
-                const ros::VoidConstPtr& tracked_object = ros::VoidConstPtr());
+  /// What addCallback() does when the queue already holds its maximum number of callbacks
+  enum OverflowPolicy
+  {
+    DropOldest, ///< Discard the oldest pending callback to make room for the new one
+    DropNewest, ///< Discard the callback being added
+    Block,      ///< Block the adding thread until there is room
+    Coalesce    ///< Replace the oldest pending callback with the same owner id, otherwise DropNewest
+  };
+
+  CallbackQueue(CallbackQueueManager* parent);
   ~CallbackQueue();
 
   virtual void addCallback(const ros::CallbackInterfacePtr& callback, uint64_t owner_id = 0);
@@ -60,11 +93,157 @@ public:
 
   uint32_t callOne();
 
+  /**
+   * \brief Stop accepting and calling callbacks
+   *
+   * Callbacks already running are not waited for; CallbackQueueManager::removeQueue() does that.
+   */
+  void disable();
+  bool isEnabled();
+
+  /// Drop the callbacks added before stamp when they come up, instead of calling them
+  void discardAddedBefore(const ros::WallTime& stamp);
+
+  /**
+   * \brief Limit the number of pending callbacks
+   * \param max_size Maximum number of pending callbacks, 0 for unbounded
+   * \param policy What to do with callbacks added while the queue is full
+   *
+   * Block falls back to DropNewest when the callback is added from a thread that is itself
+   * executing a nodelet callback, since waiting there could deadlock the worker that would
+   * otherwise drain this queue.
+   */
+  void setMaxSize(uint32_t max_size, OverflowPolicy policy = DropOldest);
+  uint32_t getMaxSize();
+  OverflowPolicy getOverflowPolicy();
+
+  /// Number of callbacks waiting to be called
+  size_t size();
+  /// Number of callbacks discarded so far because the queue was full
+  uint64_t getDroppedCount();
+
+  /// Time callbacks spent waiting in the queue, from addCallback() until they were called
+  struct LatencyStats
+  {
+    LatencyStats()
+    : count(0)
+    {}
+
+    uint64_t count;          ///< Callbacks called so far
+    ros::WallDuration total; ///< Sum of their latencies
+    ros::WallDuration max;   ///< Largest latency seen
+  };
+  LatencyStats getLatencyStats();
+
+  /// CPU time the calling threads spent in this queue's callbacks
+  ros::WallDuration getCPUTime();
+
+  /// Charge allocations made by this queue's callbacks to account, if not NULL.  Set before use.
+  void setMemoryAccount(MemoryAccount* account);
+
+  /// Latency of the callback executing in this thread, zero outside of nodelet callbacks
+  static ros::WallDuration getCurrentLatency();
+
 private:
+  // Per owner id state.  Lets removeByID() wait for in-progress calls with the same owner id to
+  // finish, and retire the owner's pending callbacks without looking for them.  Kept until the
+  // queue is destroyed, which CallbackQueueManager::removeQueue() makes sure is after any use, so
+  // nodes refer to it by plain pointer and removing an owner doesn't free anything.
+  struct IDInfo
+  {
+    IDInfo(uint64_t id)
+    : id(id)
+    , calling(0)
+    , pending(0)
+    {}
+
+    static uint32_t generation(uint64_t pending) { return (uint32_t)(pending >> 32); }
+    static uint32_t count(uint64_t pending) { return (uint32_t)pending; }
+
+    uint64_t id;
+    boost::atomic<uint32_t> calling; ///< Calls in progress, or about to check the generation
+    /// Generation in the high half, bumped by removeByID(); its callbacks counted in size_ in the low half
+    boost::atomic<uint64_t> pending;
+  };
+  typedef boost::unordered_map<uint64_t, IDInfo*> M_IDInfo;
+
+  // Node of the pending list, allocated per added callback
+  struct Node
+  {
+    Node()
+    : next(0)
+    , id_info(0)
+    , generation(0)
+    {}
+
+    boost::atomic<Node*> next;
+    ros::CallbackInterfacePtr callback;
+    IDInfo* id_info;
+    uint32_t generation; ///< Of id_info when the callback was added
+    ros::WallTime stamp; ///< When the callback was added
+  };
+
+  // What the current thread is calling, if anything
+  struct CurrentCall
+  {
+    CurrentCall()
+    : id_info(0)
+    {}
+
+    IDInfo* id_info;
+    ros::WallDuration latency;
+  };
+
+  IDInfo* getIDInfo(uint64_t owner_id);
+  static bool removed(const Node* node);
+  bool reserve(uint32_t max_size);
+  bool reserveBlocking(uint32_t max_size);
+  void released(uint32_t count);
+  void recordLatency(const ros::WallDuration& latency);
+  bool track(Node* node);
+  bool untrack(Node* node);
+  void push(Node* node);
+  Node* pop();
+  Node* unlinkOldest(uint64_t owner_id);
+
   CallbackQueueManager* parent_;
-  ros::CallbackQueue queue_;
-  ros::VoidConstWPtr tracked_object_;
-  bool has_tracked_object_;
+  boost::atomic<bool> enabled_;
+
+  // Vyukov's intrusive MPSC queue.  Producers only exchange head_ and then link the previous head
+  // to their node.  Consumers (callOne(), and producers evicting a node when the queue is full)
+  // serialize on consumer_mutex_ and own tail_.  stub_ keeps the list non-empty.
+  boost::atomic<Node*> head_;
+  Node* tail_;
+  Node stub_;
+  boost::mutex consumer_mutex_;
+
+  /// Linked nodes, including ones reserved but not yet linked.  Nodes whose owner has been removed
+  /// stay linked until a consumer reaches them, but no longer count.
+  boost::atomic<uint32_t> size_;
+  boost::atomic<uint32_t> max_size_;
+  boost::atomic<OverflowPolicy> overflow_policy_;
+  boost::atomic<uint64_t> dropped_;
+
+  boost::atomic<uint64_t> latency_count_;
+  boost::atomic<uint64_t> latency_total_ns_;
+  boost::atomic<uint64_t> latency_max_ns_;
+  boost::atomic<uint64_t> cpu_ns_;
+  boost::atomic<uint64_t> discard_before_ns_;
+  MemoryAccount* memory_account_;
+
+  boost::mutex space_mutex_;
+  boost::condition_variable space_cond_; ///< Signalled when a Block-ed producer may have room
+  boost::atomic<uint32_t> blocked_producers_;
+
+  M_IDInfo id_info_;
+  boost::mutex id_info_mutex_;
+  // Recently used entries of id_info_, by a hash of the owner id
+  static const size_t ID_INFO_CACHE_SIZE = 16;
+  boost::atomic<IDInfo*> id_info_cache_[ID_INFO_CACHE_SIZE];
+
+  static CurrentCall& currentCall();
+
+  static boost::thread_specific_ptr<CurrentCall> current_call_;
 };
 
 } // namespace detail
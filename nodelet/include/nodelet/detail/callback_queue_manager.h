@@ -32,6 +32,7 @@
 
 #include <ros/types.h>
 
+#include <boost/atomic.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/scoped_array.hpp>
 #include <boost/unordered_map.hpp>
@@ -59,6 +60,11 @@ typedef boost::shared_ptr<CallbackQueue> CallbackQueuePtr;
  * finding the thread with the fewest pending tasks and appending to that list.  This does mean that a
  * single long-running callback can potentially block other callbacks from being executed.  Some kind of
  * work-stealing could mitigate this, and is a good direction for future work.
+ *
+ * Queues are referenced by raw pointer while callbacks are being dispatched, so no reference counts
+ * are touched per callback.  Instead each worker thread marks the batches of work it processes and
+ * the queue it is calling.  removeQueue() waits only for the workers calling the queue, and leaves
+ * it to workers still in a batch to release the queue once that batch is done.
  */
 class CallbackQueueManager
 {
@@ -71,9 +77,24 @@ public:
   CallbackQueueManager(uint32_t num_worker_threads = 0);
   ~CallbackQueueManager();
 
-  void addQueue(const CallbackQueuePtr& queue, bool threaded);
+  /**
+   * \brief Start managing a queue
+   * \param paused Don't call the queue's callbacks until resumeQueue(), just let them pile up
+   */
+  void addQueue(const CallbackQueuePtr& queue, bool threaded, bool paused = false);
+  /// Start calling a queue added paused, including the callbacks it got meanwhile
+  void resumeQueue(const CallbackQueuePtr& queue);
+  /**
+   * \brief Disable a queue and stop calling it
+   *
+   * When this returns none of the queue's callbacks are running or will run, unless it is called
+   * from one of the queue's own callbacks.
+   */
   void removeQueue(const CallbackQueuePtr& queue);
-  void callbackAdded(const CallbackQueuePtr& queue);
+  void callbackAdded(CallbackQueue* queue);
+
+  /// Index of the worker thread a single-threaded queue is assigned to right now, or -1 if none
+  int32_t getQueueThread(const CallbackQueuePtr& queue);
 
   uint32_t getNumWorkerThreads();
 
@@ -86,11 +107,14 @@ private:
 
   class ThreadInfo;
   ThreadInfo* getSmallestQueue();
+  ThreadInfo* getCurrentThreadInfo();
 
   struct QueueInfo
   {
     QueueInfo()
     : threaded(false)
+    , paused(false)
+    , deferred(0)
     , thread_index(0xffffffff)
     , in_thread(0)
     {}
@@ -98,6 +122,10 @@ private:
     CallbackQueuePtr queue;
     bool threaded;
 
+    // Protected by queues_mutex_
+    bool paused;
+    uint32_t deferred; ///< callbackAdded() notifications held back while paused
+
     // Only used if threaded == false
     boost::mutex st_mutex;
     /// @todo Could get rid of st_mutex by updating [thread_index|in_thread] atomically
@@ -111,23 +139,36 @@ private:
   boost::mutex queues_mutex_;
 
   /// @todo SRMW lockfree queue. waiting_mutex_ has the potential for a lot of contention
-  typedef std::vector<CallbackQueuePtr> V_Queue;
+  typedef std::vector<CallbackQueue*> V_Queue;
   V_Queue waiting_;
   boost::mutex waiting_mutex_;
   boost::condition_variable waiting_cond_;
   boost::thread_group tg_;
 
+  typedef std::vector<QueueInfo*> V_QueueInfo;
+  typedef std::vector<QueueInfoPtr> V_QueueInfoPtr;
+
   struct ThreadInfo
   {
     ThreadInfo()
     : calling(0)
+    , epoch(0)
+    , current(0)
     {}
 
     /// @todo SRSW lockfree queue
     boost::mutex queue_mutex;
     boost::condition_variable queue_cond;
-    std::vector<std::pair<CallbackQueuePtr, QueueInfoPtr> > queue;
+    V_QueueInfo queue;
     boost::detail::atomic_count calling;
+    /// Odd while the thread is working through a batch taken from queue.  Only changes under queue_mutex.
+    boost::atomic<uint32_t> epoch;
+    /// Queue the thread is inside callOne() of, if any
+    boost::atomic<QueueInfo*> current;
+    boost::thread::id id;
+    /// Queues removed while the thread was in a batch, released when the batch is done.  Protected by
+    /// queue_mutex.
+    V_QueueInfoPtr retired;
 
 #ifdef NODELET_QUEUE_DEBUG
     struct Record
@@ -149,15 +190,23 @@ private:
     static const int ACTUAL_SIZE =
       sizeof(boost::mutex) +
       sizeof(boost::condition_variable) +
-      sizeof(std::vector<std::pair<CallbackQueuePtr, QueueInfoPtr> >) +
-      sizeof(boost::detail::atomic_count);
+      sizeof(V_QueueInfo) +
+      sizeof(boost::detail::atomic_count) +
+      sizeof(boost::atomic<uint32_t>) +
+      sizeof(boost::atomic<QueueInfo*>) +
+      sizeof(boost::thread::id) +
+      sizeof(V_QueueInfoPtr);
     uint8_t pad[((ACTUAL_SIZE + 63) & ~63) - ACTUAL_SIZE];
   };
   /// @todo Use cache-aligned allocator for thread_info_
   typedef boost::scoped_array<ThreadInfo> V_ThreadInfo;
   V_ThreadInfo thread_info_;
 
-  bool running_;
+  boost::mutex quiescent_mutex_;
+  boost::condition_variable quiescent_cond_; ///< Signalled when a worker leaves callOne()
+  boost::atomic<uint32_t> quiescent_waiters_;
+
+  boost::atomic<bool> running_;
   uint32_t num_worker_threads_;
 };
 
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2010, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NODELET_CLASS_INDEX_H
+#define NODELET_CLASS_INDEX_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace nodelet
+{
+namespace detail
+{
+
+/**
+ * \brief Internal use
+ *
+ * Persistent index of the declared nodelet classes, kept in $ROS_HOME/nodelet_index so that
+ * Loader and the declared_nodelets script don't have to crawl every package on startup.
+ *
+ * The index lists the plugin description files and the manifests of the packages providing them,
+ * along with their modification times and sizes, and every directory crawled for packages below
+ * the ROS_PACKAGE_PATH roots.  load() rejects the index if ROS_PACKAGE_PATH or any of these files
+ * or directories changed, so new packages invalidate it wherever they are added.  A class added to
+ * an existing package without touching any of them is still found, because Loader refreshes the
+ * index whenever it can't find a type, and declared_nodelets --refresh rebuilds it.
+ *
+ * The file is line based with tab separated fields:
+ * \verbatim
+   nodelet_index   2
+   package_path    <ROS_PACKAGE_PATH>
+   file            <mtime> <size> <path>       (one per tracked file or directory)
+   plugin          <plugin description file>   (one per file, in crawl order)
+   class           <type> <plugin description file> <library path, may be empty>
+   \endverbatim
+ */
+class ClassIndex
+{
+public:
+  struct Class
+  {
+    std::string type;
+    std::string plugin_xml;
+    std::string library;
+  };
+
+  /// \param path Index file, the default location if empty
+  explicit ClassIndex(const std::string& path = std::string());
+
+  /// Read the index file.  Returns false if it is missing, malformed or out of date.
+  bool load();
+
+  /**
+   * \brief Replace the index contents and write the index file
+   *
+   * The manifest tracked for each plugin description file is the closest package.xml or
+   * manifest.xml above it.  Failing to write is not an error; the index is only a cache.
+   */
+  void save(const std::vector<std::string>& plugin_xml_paths, const std::vector<Class>& classes);
+
+  const std::string& getPath() const { return path_; }
+  const std::vector<std::string>& getPluginXmlPaths() const { return plugin_xml_paths_; }
+  const std::vector<Class>& getClasses() const { return classes_; }
+
+  /// $ROS_HOME/nodelet_index, with ROS_HOME defaulting to ~/.ros
+  static std::string getDefaultPath();
+
+private:
+  struct File
+  {
+    std::string path;
+    int64_t mtime;
+    int64_t size;
+  };
+
+  static bool stat(const std::string& path, File& file);
+  static std::string findManifest(const std::string& plugin_xml);
+  static std::vector<std::string> getPackagePathRoots();
+  /// Append dir and the non-package directories below it that a package crawl looks into
+  static void getCrawledDirectories(const std::string& dir, std::vector<std::string>& dirs);
+
+  std::string path_;
+  std::vector<std::string> plugin_xml_paths_;
+  std::vector<Class> classes_;
+};
+
+} // namespace detail
+} // namespace nodelet
+
+#endif // NODELET_CLASS_INDEX_H
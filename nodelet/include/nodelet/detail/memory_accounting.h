@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2010, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NODELET_MEMORY_ACCOUNTING_H
+#define NODELET_MEMORY_ACCOUNTING_H
+
+#include <boost/atomic.hpp>
+#include <boost/utility.hpp>
+
+#include <stdint.h>
+
+namespace nodelet
+{
+namespace detail
+{
+
+/**
+ * \brief Internal use
+ *
+ * Heap memory charged to one nodelet: what operator new allocated while one of its callbacks, its
+ * constructor or its onInit() was running on the thread.  Memory is uncharged when it's freed,
+ * whichever thread frees it.
+ *
+ * Accounting is off unless the process runs with NODELET_MEMORY_ACCOUNTING set, and only the nodelet
+ * executable replaces operator new to do it.  Then each allocation carries a 16 byte header saying
+ * which account to uncharge, and costs a few atomic additions.  Memory from malloc() is not counted.
+ *
+ * Memory charged to a nodelet can outlive it, so each live allocation holds a reference to its
+ * account, as does the nodelet.  The account is freed with the last one.
+ */
+struct MemoryAccount
+{
+  MemoryAccount()
+  : live_bytes(0)
+  , allocations(0)
+  , allocated_bytes(0)
+  , references(1)
+  {}
+
+  boost::atomic<int64_t> live_bytes;
+  boost::atomic<uint64_t> allocations;
+  boost::atomic<uint64_t> allocated_bytes;
+  boost::atomic<uint32_t> references; ///< The owner's, plus one per live allocation
+};
+
+/// Called by the operator new replacement, on the first allocation in the process, if accounting is wanted
+void enableMemoryAccounting();
+bool isMemoryAccountingEnabled();
+
+/// A new account holding one reference for its owner, or NULL if accounting is off
+MemoryAccount* createMemoryAccount();
+
+/**
+ * \brief Drop a reference to an account, freeing it with the last one
+ *
+ * The owner drops its reference once nothing will be charged to the account any more, e.g. when
+ * its nodelet is unloaded or fails to load.  Does nothing for a NULL account.
+ */
+void releaseMemoryAccount(MemoryAccount* account);
+
+/// The account that allocations on this thread are charged to, or NULL
+MemoryAccount* getCurrentMemoryAccount();
+
+/// Charges allocations on this thread to an account while in scope.  Does nothing for a NULL account.
+class MemoryAccountScope : boost::noncopyable
+{
+public:
+  explicit MemoryAccountScope(MemoryAccount* account);
+  ~MemoryAccountScope();
+
+private:
+  MemoryAccount* account_;
+  MemoryAccount* outer_;
+};
+
+} // namespace detail
+} // namespace nodelet
+
+#endif // NODELET_MEMORY_ACCOUNTING_H
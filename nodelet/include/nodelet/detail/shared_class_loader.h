@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2010, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NODELET_SHARED_CLASS_LOADER_H
+#define NODELET_SHARED_CLASS_LOADER_H
+
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_loader.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+#include <boost/weak_ptr.hpp>
+
+namespace nodelet
+{
+namespace detail
+{
+
+/**
+ * \brief Internal use
+ *
+ * The pluginlib class loader, shared by all Loaders in the process.  Building one means parsing
+ * every plugin description file, and keeps a copy of all class metadata.
+ */
+class SharedClassLoader : boost::noncopyable
+{
+public:
+  typedef pluginlib::ClassLoader<Nodelet> ClassLoader;
+
+  boost::shared_ptr<ClassLoader> loader;
+  boost::mutex mutex; ///<! pluginlib's ClassLoader isn't thread-safe, every use must lock this
+
+  /// The process-wide instance, created on first use and released when no Loader uses it
+  static boost::shared_ptr<SharedClassLoader> get();
+
+  /// Rescan all packages for nodelet classes, whether or not the loader was given plugin description files
+  void refresh();
+
+private:
+  SharedClassLoader();
+  void updateClassIndex();
+
+  static boost::mutex registry_mutex_;
+  static boost::weak_ptr<SharedClassLoader> registry_;
+};
+
+} // namespace detail
+} // namespace nodelet
+
+#endif // NODELET_SHARED_CLASS_LOADER_H
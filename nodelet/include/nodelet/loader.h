@@ -38,9 +38,11 @@
 
 #include <map>
 #include <vector>
+#include <stdint.h>
 #include <boost/function.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/future.hpp>
 #include <boost/thread/mutex.hpp>
 
 namespace ros
@@ -48,6 +50,11 @@ namespace ros
 class NodeHandle;
 }
 
+namespace XmlRpc
+{
+class XmlRpcValue;
+}
+
 namespace nodelet
 {
 class Nodelet;
@@ -62,6 +69,12 @@ class Loader
 public:
   /** \brief Construct the nodelet loader with optional ros API at default location of NodeHandle("~")*/
   Loader(bool provide_ros_api = true);
+  /**
+   * \brief Construct the nodelet loader with optional ros API, and a number of worker threads
+   * \param num_worker_threads Threads to run nodelet callbacks on, 0 for one per CPU core.  With the
+   * ros API, the ~num_worker_threads parameter takes precedence.
+   */
+  Loader(bool provide_ros_api, uint32_t num_worker_threads);
   /** \brief Construct the nodelet loader with optional ros API in namespace of passed NodeHandle */
   Loader(const ros::NodeHandle& server_nh);
   /**
@@ -72,21 +85,171 @@ public:
   
   ~Loader();
 
-  /** \brief Load a nodelet */
+  /**
+   * \brief Load a nodelet
+   *
+   * Safe to call from several threads at once.  The nodelet's name is reserved up front, but the
+   * nodelet only shows up in listLoadedNodelets() and can only be unloaded once its onInit() has
+   * returned.
+   */
   bool load(const std::string& name, const std::string& type, const M_string& remappings,
             const V_string& my_argv);
 
+  /** \brief Arguments of one load() call, for loadMany() */
+  struct LoadRequest
+  {
+    std::string name;
+    std::string type;
+    M_string remappings;
+    V_string my_argv;
+    V_string depends; ///<! Nodelets to load first, from the same call or already loaded
+    std::string pool; ///<! Worker thread pool from addPool() to run the callbacks on, empty for the default one
+    boost::shared_ptr<XmlRpc::XmlRpcValue> params; ///<! Private parameters to set, and serve to the nodelet, if any
+  };
+
+  /** \brief Load a nodelet, like load() but with all options */
+  bool load(const LoadRequest& request);
+
+  /**
+   * \brief Add a named pool of worker threads that nodelets can be loaded into
+   *
+   * Keeps the callbacks of the nodelets in a pool from competing for threads with those in other
+   * pools.  Pools last as long as the Loader.
+   * \param num_threads Number of worker threads, 0 for one per CPU core
+   * \return false if a pool of that name exists already
+   */
+  bool addPool(const std::string& name, uint32_t num_threads);
+
+  /**
+   * \brief Load several nodelets concurrently
+   *
+   * A nodelet is only loaded after the nodelets it depends on.  It fails without being loaded if
+   * one of them fails, is neither part of the call nor already loaded, or depends on it in turn.
+   * \param num_threads Number of nodelets to load at once, 0 for one per CPU core
+   * \return Whether each nodelet was loaded, in the order of requests
+   */
+  std::vector<bool> loadMany(const std::vector<LoadRequest>& requests, uint32_t num_threads = 0);
+
+  /**
+   * \brief Load a graph of nodelets, as described in YAML and put on the parameter server
+   *
+   * \verbatim
+pools:                      # optional, worker threads per pool
+  camera: 2
+nodelets:
+  - name: camera/rectify    # resolved in the namespace of this process
+    type: image_proc/rectify
+    remap: {image_mono: image_raw}
+    params: {interpolation: 1}
+    args: [--verbose]
+    pool: camera
+    depends: [camera/driver]
+\endverbatim
+   *
+   * Sets the parameters of each nodelet, then loads them with loadMany().
+   * \return false if the graph is malformed or any nodelet failed to load
+   */
+  bool loadGraph(const XmlRpc::XmlRpcValue& graph, uint32_t num_threads = 0);
+
   /** \brief Unload a nodelet */
   bool unload(const std::string& name);
 
+  /**
+   * \brief Replace a loaded nodelet with a new instance, without a gap in between
+   *
+   * Creates and initializes the new instance with the same name, remappings, arguments and worker
+   * pool while the old one keeps running, then switches over to it and unloads the old one.  The
+   * new instance's callbacks are held back until the switch, and those added before it are
+   * dropped, so a message is handled by one instance at most.  The new instance reads its
+   * parameters from the parameter server.  Topics it advertises or
+   * subscribes to again keep their connections; services however can't be advertised twice.
+   * \param type Type of the new instance, empty for the same type
+   * \return false if the nodelet isn't loaded or the new instance fails to load, in which case
+   * the old one keeps running
+   */
+  bool reload(const std::string& name, const std::string& type = std::string());
+
+  /**
+   * \brief Unload a nodelet without waiting for it to be destroyed
+   *
+   * Takes the nodelet out at once and disables its queues, then destroys it on a reaper thread
+   * once the callbacks it is running have returned.  Waits up to drain_timeout seconds for those
+   * callbacks; how long they took is logged.  The name can't be loaded again until the nodelet has
+   * been destroyed.  Reapers don't share threads with loadAsync() and unloadAsync(), so callbacks
+   * that never return don't hold those up.  The manager offers this as ~unload_nodelet_detached.
+   * \return false if no nodelet of that name is loaded
+   */
+  bool unloadDetached(const std::string& name, double drain_timeout = 1.0);
+
+  /// Called with the result of an asynchronous load or unload
+  typedef boost::function<void (bool)> CompletionCallback;
+
+  /**
+   * \brief Load a nodelet without waiting for it
+   *
+   * Runs load() on a background thread.  Requests share a small pool of threads (~num_async_threads,
+   * 4 by default), so a nodelet with a slow onInit() only holds up requests once the pool is busy.
+   * \param done Called from the background thread with the result, if set
+   * \return The result of load()
+   */
+  boost::shared_future<bool> loadAsync(const std::string& name, const std::string& type,
+                                       const M_string& remappings, const V_string& my_argv,
+                                       const CompletionCallback& done = CompletionCallback());
+
+  /** \brief Load a nodelet without waiting for it, like loadAsync() but with all options */
+  boost::shared_future<bool> loadAsync(const LoadRequest& request,
+                                       const CompletionCallback& done = CompletionCallback());
+
+  /**
+   * \brief Unload a nodelet without waiting for it
+   *
+   * Runs unload() on a background thread, like loadAsync().
+   */
+  boost::shared_future<bool> unloadAsync(const std::string& name,
+                                         const CompletionCallback& done = CompletionCallback());
+
   /** \brief Clear all nodelets from this loader */
   bool clear();
 
   /**\brief List the names of all loaded nodelets */
   std::vector<std::string> listLoadedNodelets();
+
+  /** \brief Runtime information about a loaded nodelet, from listNodeletInfo() */
+  struct NodeletInfo
+  {
+    std::string name;
+    std::string type;
+    std::string pool;            ///<! Worker pool from addPool(), empty for the default one
+    double load_stamp;           ///<! Wall clock time the nodelet finished loading, seconds since the epoch
+    double init_duration;        ///<! Seconds spent in Nodelet::init(), including onInit()
+    uint32_t queue_depth;        ///<! Callbacks waiting in the nodelet's queues
+    uint64_t callbacks_executed;
+    double cpu_time;             ///<! CPU seconds spent in the nodelet's callbacks
+    double queue_latency_mean;   ///<! Mean seconds callbacks waited in the nodelet's queues
+    double queue_latency_max;    ///<! Longest a callback waited, in seconds
+    int32_t worker;              ///<! Worker thread running its single-threaded callbacks right now, or -1
+    uint64_t message_pool_hits;  ///<! Messages reused from the nodelet's message pools, of all types
+    uint64_t message_pool_misses;///<! Messages the pools had to allocate
+    // Heap memory allocated by the nodelet, all zero unless the manager runs with NODELET_MEMORY_ACCOUNTING set
+    int64_t memory_live_bytes;       ///<! Allocated by the nodelet and not freed yet
+    uint64_t memory_allocations;     ///<! Allocations so far
+    uint64_t memory_allocated_bytes; ///<! Bytes allocated so far, freed or not
+  };
+
+  /** \brief List all loaded nodelets with what they are doing */
+  std::vector<NodeletInfo> listNodeletInfo();
+
+  /**
+   * \brief Scheduling delay of a nodelet's callbacks, from being queued to being called
+   * \param count Number of callbacks called so far
+   * \param mean Mean time in seconds callbacks spent waiting in the nodelet's queues
+   * \param max Longest time in seconds a callback spent waiting
+   * \return false if no nodelet of that name is loaded
+   */
+  bool getCallbackQueueLatency(const std::string& name, uint64_t& count, double& mean, double& max);
   
 private:
-  boost::mutex lock_; ///<! Public methods must lock this to preserve internal integrity.
+  boost::mutex lock_; ///<! Unused, kept so that the class layout doesn't change; see Impl::lock_
   struct Impl;
   boost::scoped_ptr<Impl> impl_;
 };
@@ -0,0 +1,794 @@
+/*
+ * Copyright (c) 2010, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NODELET_LOCAL_CHANNEL_H
+#define NODELET_LOCAL_CHANNEL_H
+
+#include "nodelet/nodelet.h"
+#include "nodelet/NodeletSharedMessage.h"
+
+#include <ros/ros.h>
+#include <ros/callback_queue_interface.h>
+#include <ros/message_traits.h>
+#include <ros/serialization.h>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/utility.hpp>
+#include <boost/weak_ptr.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <set>
+#include <typeinfo>
+#include <vector>
+
+namespace nodelet
+{
+
+namespace detail
+{
+
+class LocalChannelBase
+{
+public:
+  virtual ~LocalChannelBase() {}
+};
+typedef boost::shared_ptr<LocalChannelBase> LocalChannelBasePtr;
+
+/**
+ * \brief Internal use
+ *
+ * Find the process-wide channel for a resolved topic name, calling create if there is none yet.
+ * Channels are kept for as long as a publisher or subscriber holds on to them.  Throws
+ * nodelet::Exception if the topic already has a channel for a different message type.
+ */
+LocalChannelBasePtr getLocalChannel(const std::string& topic, const std::type_info& type,
+                                    const boost::function<LocalChannelBasePtr()>& create);
+
+/**
+ * \brief Internal use
+ *
+ * Writes serialized messages one after the other into a POSIX shared memory segment, wrapping
+ * around at the end.  Readers in other processes are told where each message is with a
+ * NodeletSharedMessage.  There is no locking between processes: the segment header counts the
+ * bytes reserved so far, which is bumped before a message is written, so a reader can tell
+ * afterwards whether the message it read was overwritten meanwhile.
+ */
+class SharedMemoryWriter : boost::noncopyable
+{
+public:
+  SharedMemoryWriter();
+  ~SharedMemoryWriter();
+
+  /**
+   * \brief Reserve size bytes for a message and fill in where they are
+   *
+   * Replaces the segment with a larger one if it can't hold min_messages messages of this size.
+   * \return Where to write the message, or NULL if no segment could be created
+   */
+  uint8_t* reserve(uint32_t size, uint32_t min_messages, NodeletSharedMessage& msg);
+
+private:
+  bool create(uint64_t capacity);
+  void destroy();
+
+  std::string name_;
+  uint8_t* base_;
+  size_t mapped_size_;
+  uint64_t capacity_;
+  uint64_t head_;
+};
+
+/**
+ * \brief Internal use
+ *
+ * Maps the segments of one SharedMemoryWriter in another process, read only.
+ */
+class SharedMemoryReader : boost::noncopyable
+{
+public:
+  SharedMemoryReader();
+  ~SharedMemoryReader();
+
+  /// Where the message is, or NULL if it's gone or its segment can't be mapped
+  const uint8_t* get(const NodeletSharedMessage& msg);
+
+  /// Whether the message was still intact, to check once done reading it
+  bool valid(const NodeletSharedMessage& msg) const;
+
+  /// Whether a segment couldn't be opened for lack of permission, e.g. it belongs to another user
+  bool denied() const { return denied_; }
+
+private:
+  void unmap();
+
+  std::string name_;
+  const uint8_t* base_;
+  size_t mapped_size_;
+  bool denied_;
+};
+
+/// The topic that publishers on this host send NodeletSharedMessages for topic on
+std::string getSharedMemoryTopic(const std::string& topic);
+
+/// Queue for the NodeletSharedMessage subscriptions of this process, served by a thread of its own
+ros::CallbackQueueInterface* getSharedMemoryQueue();
+
+template<class M> class SharedMemoryReceiver;
+
+/**
+ * \brief Internal use
+ *
+ * The subscribers to one topic within this process.  publish() hands the message pointer to each
+ * subscriber's callback queue, so no copy or serialization takes place.
+ */
+template<class M>
+class LocalChannel : public LocalChannelBase
+{
+public:
+  typedef boost::shared_ptr<const M> ConstPtr;
+  typedef boost::function<void (const ConstPtr&)> Callback;
+
+  struct Subscription
+  {
+    Subscription(ros::CallbackQueueInterface* queue, const Callback& callback, uint32_t queue_size)
+    : queue(queue)
+    , callback(callback)
+    , queue_size(queue_size)
+    , sent(0)
+    , active(true)
+    , publishing(0)
+    {}
+
+    // Owner id of the callbacks added to queue, so they can be removed in one go
+    uint64_t id() const { return (uint64_t)(uintptr_t)this; }
+
+    /**
+     * Stop delivering messages.  Once this returns nothing is added to queue any more, and the
+     * callbacks that were are removed, or finished unless called from one of them.
+     */
+    void close()
+    {
+      active.store(false);
+      queue->removeByID(id());
+
+      // A publish() that found the subscription active may still be adding to the queue; wait for
+      // it, then remove what it added.  The removal above makes room for one blocked on a full queue.
+      while (publishing.load() > 0)
+      {
+        boost::this_thread::yield();
+      }
+      queue->removeByID(id());
+    }
+
+    ros::CallbackQueueInterface* queue;
+    Callback callback;
+    uint32_t queue_size;
+    boost::atomic<uint64_t> sent;
+    boost::atomic<bool> active;
+    boost::atomic<uint32_t> publishing; ///< publish() calls that may be adding to queue
+  };
+  typedef boost::shared_ptr<Subscription> SubscriptionPtr;
+  typedef std::vector<SubscriptionPtr> V_Subscription;
+  typedef boost::shared_ptr<const V_Subscription> V_SubscriptionConstPtr;
+
+  LocalChannel(const std::string& topic)
+  : topic_(topic)
+  , subscriptions_(new V_Subscription)
+  , num_publishers_(0)
+  , num_ros_subscriptions_(0)
+  {}
+
+  static LocalChannelBasePtr create(const std::string& topic)
+  {
+    return LocalChannelBasePtr(new LocalChannel<M>(topic));
+  }
+
+  static boost::shared_ptr<LocalChannel<M> > get(const std::string& topic)
+  {
+    return boost::static_pointer_cast<LocalChannel<M> >(
+        getLocalChannel(topic, typeid(M), boost::bind(&LocalChannel<M>::create, topic)));
+  }
+
+  const std::string& getTopic() const { return topic_; }
+
+  // The subscription list is copied on change, so publish() only holds the lock to take a reference.
+  // Messages from other processes on this host come in through the shared memory receiver, which
+  // exists while there are subscriptions.
+  void addSubscription(const SubscriptionPtr& sub, const boost::shared_ptr<LocalChannel<M> >& self)
+  {
+    {
+      boost::mutex::scoped_lock lock(subscriptions_mutex_);
+      boost::shared_ptr<V_Subscription> subs(new V_Subscription(*subscriptions_));
+      subs->push_back(sub);
+      subscriptions_ = subs;
+
+      if (receiver_)
+      {
+        return;
+      }
+    }
+
+    // Subscribing talks to the master, so don't keep publish() waiting meanwhile
+    boost::shared_ptr<SharedMemoryReceiver<M> > receiver(new SharedMemoryReceiver<M>(self));
+    {
+      boost::mutex::scoped_lock lock(subscriptions_mutex_);
+      if (!receiver_ && !subscriptions_->empty())
+      {
+        receiver_.swap(receiver);
+      }
+    }
+
+    // Another subscription got there first, or they are all gone again
+    receiver.reset();
+  }
+
+  void removeSubscription(const SubscriptionPtr& sub)
+  {
+    boost::shared_ptr<SharedMemoryReceiver<M> > receiver;
+    {
+      boost::mutex::scoped_lock lock(subscriptions_mutex_);
+      boost::shared_ptr<V_Subscription> subs(new V_Subscription(*subscriptions_));
+      subs->erase(std::remove(subs->begin(), subs->end(), sub), subs->end());
+      subscriptions_ = subs;
+
+      if (subs->empty())
+      {
+        receiver.swap(receiver_);
+      }
+    }
+
+    // Destroyed outside the lock, as it waits for a message being delivered through publish()
+    receiver.reset();
+  }
+
+  V_SubscriptionConstPtr getSubscriptions() const
+  {
+    boost::mutex::scoped_lock lock(subscriptions_mutex_);
+    return subscriptions_;
+  }
+
+  void publish(const ConstPtr& msg) const
+  {
+    V_SubscriptionConstPtr subs = getSubscriptions();
+    for (typename V_Subscription::const_iterator it = subs->begin(); it != subs->end(); ++it)
+    {
+      // Paired with Subscription::close(): either it sees us publishing, or we see it inactive
+      const SubscriptionPtr& sub = *it;
+      ++sub->publishing;
+      if (sub->active.load())
+      {
+        uint64_t seq = ++sub->sent;
+        sub->queue->addCallback(ros::CallbackInterfacePtr(new Call(sub, msg, seq)), sub->id());
+      }
+      --sub->publishing;
+    }
+  }
+
+  /// Called from the subscriber's ROS subscription, for messages that didn't come from publish()
+  static void remoteCallback(const boost::shared_ptr<LocalChannel<M> >& channel, const SubscriptionPtr& sub,
+                             const ros::MessageEvent<M const>& event)
+  {
+    // A local publisher only publishes over ROS when someone outside this process is listening,
+    // and then the local subscribers see the message twice.  Drop the copy from roscpp, and the
+    // ones from publishers on this host that also send us their messages in shared memory.
+    if (channel->num_publishers_.load() > 0 && event.getPublisherName() == ros::this_node::getName())
+    {
+      return;
+    }
+
+    if (channel->isSharedMemoryPublisher(event.getPublisherName()))
+    {
+      return;
+    }
+
+    sub->callback(event.getConstMessage());
+  }
+
+  uint32_t getNumLocalSubscribers() const { return getSubscriptions()->size(); }
+
+  void addSharedMemoryPublisher(const std::string& name)
+  {
+    boost::mutex::scoped_lock lock(shm_publishers_mutex_);
+    shm_publishers_.insert(name);
+  }
+
+  void clearSharedMemoryPublishers()
+  {
+    boost::mutex::scoped_lock lock(shm_publishers_mutex_);
+    shm_publishers_.clear();
+  }
+
+  bool isSharedMemoryPublisher(const std::string& name) const
+  {
+    boost::mutex::scoped_lock lock(shm_publishers_mutex_);
+    return shm_publishers_.count(name) > 0;
+  }
+
+  boost::atomic<uint32_t>& numPublishers() { return num_publishers_; }
+  boost::atomic<uint32_t>& numROSSubscriptions() { return num_ros_subscriptions_; }
+
+private:
+  class Call : public ros::CallbackInterface
+  {
+  public:
+    Call(const SubscriptionPtr& sub, const ConstPtr& msg, uint64_t seq)
+    : sub_(sub)
+    , msg_(msg)
+    , seq_(seq)
+    {}
+
+    virtual CallResult call()
+    {
+      // Keep only the newest queue_size messages, like a ROS subscriber does
+      if (!sub_->active.load())
+      {
+        return Success;
+      }
+      if (sub_->queue_size == 0 || sub_->sent.load() - seq_ < sub_->queue_size)
+      {
+        sub_->callback(msg_);
+      }
+
+      return Success;
+    }
+
+  private:
+    SubscriptionPtr sub_;
+    ConstPtr msg_;
+    uint64_t seq_;
+  };
+
+  std::string topic_;
+  mutable boost::mutex subscriptions_mutex_;
+  V_SubscriptionConstPtr subscriptions_;
+  boost::shared_ptr<SharedMemoryReceiver<M> > receiver_;
+  boost::atomic<uint32_t> num_publishers_;
+  boost::atomic<uint32_t> num_ros_subscriptions_;
+
+  mutable boost::mutex shm_publishers_mutex_;
+  std::set<std::string> shm_publishers_;
+};
+
+/**
+ * \brief Internal use
+ *
+ * Reads the messages that publishers in other processes on this host put in shared memory for a
+ * channel.  Each is deserialized once, then delivered to all the channel's subscribers by pointer.
+ */
+template<class M>
+class SharedMemoryReceiver : boost::noncopyable
+{
+public:
+  SharedMemoryReceiver(const boost::shared_ptr<LocalChannel<M> >& channel)
+  : channel_(channel)
+  , dropped_(0)
+  {
+    ros::NodeHandle nh;
+    nh.setCallbackQueue(getSharedMemoryQueue());
+    boost::function<void (const ros::MessageEvent<NodeletSharedMessage const>&)> callback =
+        boost::bind(&SharedMemoryReceiver<M>::callback, this, _1);
+    sub_ = nh.subscribe<NodeletSharedMessage>(getSharedMemoryTopic(channel->getTopic()), 100, callback);
+  }
+
+  ~SharedMemoryReceiver()
+  {
+    sub_.shutdown();
+  }
+
+private:
+  void callback(const ros::MessageEvent<NodeletSharedMessage const>& event)
+  {
+    // Publishers in this process have delivered the message already
+    const std::string& publisher = event.getPublisherName();
+    if (publisher == ros::this_node::getName())
+    {
+      return;
+    }
+
+    boost::shared_ptr<LocalChannel<M> > channel = channel_.lock();
+    if (!channel)
+    {
+      return;
+    }
+
+    const NodeletSharedMessage& shared = *event.getConstMessage();
+    if (shared.md5sum != ros::message_traits::md5sum<M>())
+    {
+      ROS_WARN_ONCE("Ignoring shared memory messages of the wrong type on [%s] from [%s]",
+                    channel->getTopic().c_str(), publisher.c_str());
+      return;
+    }
+
+    ros::WallTime now = ros::WallTime::now();
+    pruneReaders(now);
+
+    // A publisher's segment keeps its name, up to a generation suffix, when it is replaced
+    std::string writer = publisher + shared.segment.substr(0, shared.segment.rfind('_'));
+    Reader& entry = readers_[writer];
+    entry.last_used = now;
+    boost::shared_ptr<SharedMemoryReader>& reader = entry.reader;
+    if (!reader)
+    {
+      reader.reset(new SharedMemoryReader);
+    }
+
+    const uint8_t* data = reader->get(shared);
+    if (!data)
+    {
+      ++dropped_;
+      if (reader->denied())
+      {
+        // The publisher counts us as getting its messages here, and doesn't send them over ROS.
+        // Leaving makes it send them to our ROS subscriptions again.
+        ROS_WARN("No access to the shared memory of [%s] on [%s], receiving over ROS instead",
+                 publisher.c_str(), channel->getTopic().c_str());
+        sub_.shutdown();
+        readers_.clear();
+        channel->clearSharedMemoryPublishers();
+      }
+      return;
+    }
+
+    // Lengths inside a message the writer is overwriting can be anything, and deserializing would
+    // allocate what they say.  Copy the message, which get() checked fits in the segment, and
+    // only deserialize the copy once it's known to be intact.
+    buffer_.resize(shared.size);
+    if (!buffer_.empty())
+    {
+      std::memcpy(&buffer_[0], data, buffer_.size());
+    }
+
+    if (!reader->valid(shared))
+    {
+      ++dropped_;
+      ROS_DEBUG("Dropped a shared memory message on [%s] that was overwritten while reading it, %lu so far",
+                channel->getTopic().c_str(), (unsigned long)dropped_);
+      return;
+    }
+
+    boost::shared_ptr<M> msg(new M);
+    try
+    {
+      ros::serialization::IStream stream(buffer_.empty() ? NULL : &buffer_[0], buffer_.size());
+      ros::serialization::deserialize(stream, *msg);
+    }
+    catch (std::exception& e)
+    {
+      ++dropped_;
+      ROS_ERROR_ONCE("Failed to deserialize a shared memory message on [%s] from [%s]: %s",
+                     channel->getTopic().c_str(), publisher.c_str(), e.what());
+      return;
+    }
+
+    channel->addSharedMemoryPublisher(publisher);
+    channel->publish(msg);
+  }
+
+  // Unmaps the segments of publishers that have been quiet for a while, most likely gone
+  void pruneReaders(const ros::WallTime& now)
+  {
+    const ros::WallDuration max_idle(30.0);
+    if (now - last_prune_ < max_idle)
+    {
+      return;
+    }
+    last_prune_ = now;
+
+    typename M_Reader::iterator it = readers_.begin();
+    while (it != readers_.end())
+    {
+      if (now - it->second.last_used >= max_idle)
+      {
+        readers_.erase(it++);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+
+  struct Reader
+  {
+    boost::shared_ptr<SharedMemoryReader> reader;
+    ros::WallTime last_used;
+  };
+  typedef std::map<std::string, Reader> M_Reader;
+
+  boost::weak_ptr<LocalChannel<M> > channel_;
+  ros::Subscriber sub_;
+  // By publisher and segment name, only used from the callback, which runs on one thread
+  M_Reader readers_;
+  std::vector<uint8_t> buffer_;
+  ros::WallTime last_prune_;
+  uint64_t dropped_;
+};
+
+class LocalSubscriberImplBase
+{
+public:
+  virtual ~LocalSubscriberImplBase() {}
+  virtual std::string getTopic() const = 0;
+  virtual uint32_t getNumPublishers() const = 0;
+};
+
+template<class M>
+class LocalSubscriberImpl : public LocalSubscriberImplBase
+{
+public:
+  typedef LocalChannel<M> Channel;
+
+  LocalSubscriberImpl(ros::NodeHandle& nh, const std::string& topic, uint32_t queue_size,
+                      const typename Channel::Callback& callback)
+  : channel_(Channel::get(nh.resolveName(topic)))
+  , sub_(new typename Channel::Subscription(nh.getCallbackQueue(), callback, queue_size))
+  {
+    channel_->addSubscription(sub_, channel_);
+    ++channel_->numROSSubscriptions();
+    boost::function<void (const ros::MessageEvent<M const>&)> remote_callback =
+        boost::bind(&Channel::remoteCallback, channel_, sub_, _1);
+    ros_sub_ = nh.subscribe<M>(topic, queue_size, remote_callback);
+  }
+
+  virtual ~LocalSubscriberImpl()
+  {
+    ros_sub_.shutdown();
+    --channel_->numROSSubscriptions();
+    channel_->removeSubscription(sub_);
+    // Drops messages still waiting in the queue, and waits for one being delivered
+    sub_->close();
+  }
+
+  virtual std::string getTopic() const { return channel_->getTopic(); }
+
+  virtual uint32_t getNumPublishers() const
+  {
+    // roscpp counts publishers in this process as one
+    uint32_t local = channel_->numPublishers().load();
+    uint32_t ros = ros_sub_.getNumPublishers();
+    return local + (local > 0 && ros > 0 ? ros - 1 : ros);
+  }
+
+private:
+  boost::shared_ptr<Channel> channel_;
+  typename Channel::SubscriptionPtr sub_;
+  ros::Subscriber ros_sub_;
+};
+
+} // namespace detail
+
+/**
+ * \brief Publishes to subscribers in this process by pointer, and to everyone else over ROS
+ *
+ * Subscribers created with Nodelet::subscribeLocal() (or LocalSubscriber) in the same process get
+ * the published message itself, queued straight into their callback queue.  Nothing is copied or
+ * serialized, so a message must not be modified once it's published.  Processes on the same host
+ * that subscribe with the local API, e.g. other managers, get the message serialized into shared
+ * memory, and deserialize it once for all their subscribers.  The message is also published on a
+ * regular ROS topic of the same name whenever any other subscriber is connected, so tools like
+ * rostopic and nodes on other hosts still see it.
+ *
+ * In-process subscribers only see messages from local publishers, so both ends of a topic within
+ * one process should use the local API.  Like ros::Publisher, copies share one advertisement, which
+ * goes away when the last copy is destroyed.
+ */
+template<class M>
+class LocalPublisher
+{
+public:
+  typedef boost::shared_ptr<const M> ConstPtr;
+
+  LocalPublisher() {}
+
+  LocalPublisher(ros::NodeHandle& nh, const std::string& topic, uint32_t queue_size)
+  : impl_(new Impl(nh, topic, queue_size))
+  {}
+
+  void publish(const ConstPtr& msg) const
+  {
+    if (!impl_)
+    {
+      ROS_ASSERT_MSG(false, "Call to publish() on an invalid LocalPublisher");
+      return;
+    }
+
+    impl_->channel->publish(msg);
+
+    // Processes on this host with local subscribers are sent the message through shared memory.
+    // They also subscribe to the ROS topic for publishers elsewhere, so don't count them again.
+    // roscpp counts all the subscriptions in one process as a single subscriber.
+    uint32_t shm_subscribers = impl_->shm_pub.getNumSubscribers();
+    uint32_t shm_in_process = impl_->channel->getNumLocalSubscribers() > 0 ? 1 : 0;
+    uint32_t shm_remote = shm_subscribers > shm_in_process ? shm_subscribers - shm_in_process : 0;
+    if (shm_remote > 0 && !impl_->publishShared(*msg))
+    {
+      shm_remote = 0;
+    }
+
+    uint32_t in_process = impl_->channel->numROSSubscriptions().load() > 0 ? 1 : 0;
+    if (impl_->pub.getNumSubscribers() > in_process + shm_remote)
+    {
+      impl_->pub.publish(msg);
+    }
+  }
+
+  void publish(const boost::shared_ptr<M>& msg) const
+  {
+    publish(ConstPtr(msg));
+  }
+
+  std::string getTopic() const
+  {
+    return impl_ ? impl_->channel->getTopic() : std::string();
+  }
+
+  /// Subscribers in this process plus those connected over ROS
+  uint32_t getNumSubscribers() const
+  {
+    if (!impl_)
+    {
+      return 0;
+    }
+
+    uint32_t local = impl_->channel->getNumLocalSubscribers();
+    uint32_t ros = impl_->pub.getNumSubscribers();
+    uint32_t in_process = impl_->channel->numROSSubscriptions().load() > 0 ? 1 : 0;
+    return local + (ros > in_process ? ros - in_process : 0);
+  }
+
+  void shutdown()
+  {
+    impl_.reset();
+  }
+
+  operator void*() const { return impl_ ? (void*)1 : (void*)0; }
+
+private:
+  struct Impl
+  {
+    Impl(ros::NodeHandle& nh, const std::string& topic, uint32_t queue_size)
+    : channel(detail::LocalChannel<M>::get(nh.resolveName(topic)))
+    , pub(nh.advertise<M>(topic, queue_size))
+    , shm_pub(nh.advertise<NodeletSharedMessage>(detail::getSharedMemoryTopic(channel->getTopic()), queue_size))
+    , queue_size(queue_size)
+    {
+      ++channel->numPublishers();
+    }
+
+    ~Impl()
+    {
+      --channel->numPublishers();
+    }
+
+    // Serialize the message into shared memory and tell the readers where it is
+    bool publishShared(const M& msg)
+    {
+      NodeletSharedMessage::Ptr shared(new NodeletSharedMessage);
+      {
+        boost::mutex::scoped_lock lock(shm_mutex);
+        uint32_t size = ros::serialization::serializationLength(msg);
+        uint8_t* data = shm_writer.reserve(size, queue_size, *shared);
+        if (!data)
+        {
+          return false;
+        }
+
+        ros::serialization::OStream stream(data, size);
+        ros::serialization::serialize(stream, msg);
+      }
+
+      shared->md5sum = ros::message_traits::md5sum<M>();
+      shm_pub.publish(shared);
+      return true;
+    }
+
+    boost::shared_ptr<detail::LocalChannel<M> > channel;
+    ros::Publisher pub;
+    ros::Publisher shm_pub;
+    uint32_t queue_size;
+    boost::mutex shm_mutex;
+    detail::SharedMemoryWriter shm_writer;
+  };
+
+  boost::shared_ptr<Impl> impl_;
+};
+
+/**
+ * \brief Receives messages from LocalPublishers in this process by pointer, and from anyone else over ROS
+ *
+ * Callbacks run from the callback queue of the NodeHandle it was created with, so for a nodelet
+ * they are serialized with the nodelet's other callbacks as usual.  queue_size limits the number of
+ * messages waiting for the callback; older ones are dropped first.  Zero means no limit.  Like
+ * ros::Subscriber, copies share one subscription, which ends when the last copy is destroyed.
+ */
+class LocalSubscriber
+{
+public:
+  LocalSubscriber() {}
+
+  template<class M>
+  LocalSubscriber(ros::NodeHandle& nh, const std::string& topic, uint32_t queue_size,
+                  const boost::function<void (const boost::shared_ptr<const M>&)>& callback)
+  : impl_(new detail::LocalSubscriberImpl<M>(nh, topic, queue_size, callback))
+  {}
+
+  std::string getTopic() const
+  {
+    return impl_ ? impl_->getTopic() : std::string();
+  }
+
+  /// Publishers in this process plus those connected over ROS
+  uint32_t getNumPublishers() const
+  {
+    return impl_ ? impl_->getNumPublishers() : 0;
+  }
+
+  void shutdown()
+  {
+    impl_.reset();
+  }
+
+  operator void*() const { return impl_ ? (void*)1 : (void*)0; }
+
+private:
+  boost::shared_ptr<detail::LocalSubscriberImplBase> impl_;
+};
+
+template<class M>
+LocalPublisher<M> Nodelet::advertiseLocal(ros::NodeHandle& nh, const std::string& topic,
+                                          uint32_t queue_size) const
+{
+  return LocalPublisher<M>(nh, topic, queue_size);
+}
+
+template<class M>
+LocalSubscriber Nodelet::subscribeLocal(ros::NodeHandle& nh, const std::string& topic, uint32_t queue_size,
+                                        const boost::function<void (const boost::shared_ptr<const M>&)>& callback) const
+{
+  return LocalSubscriber(nh, topic, queue_size, callback);
+}
+
+template<class M, class T>
+LocalSubscriber Nodelet::subscribeLocal(ros::NodeHandle& nh, const std::string& topic, uint32_t queue_size,
+                                        void (T::*fp)(const boost::shared_ptr<const M>&), T* obj) const
+{
+  boost::function<void (const boost::shared_ptr<const M>&)> callback = boost::bind(fp, obj, _1);
+  return LocalSubscriber(nh, topic, queue_size, callback);
+}
+
+} // namespace nodelet
+
+#endif // NODELET_LOCAL_CHANNEL_H
@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2010, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NODELET_MESSAGE_POOL_H
+#define NODELET_MESSAGE_POOL_H
+
+#include "nodelet/nodelet.h"
+
+#include <ros/message_traits.h>
+
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cstddef>
+#include <map>
+#include <new>
+#include <typeinfo>
+#include <vector>
+
+namespace nodelet
+{
+
+namespace detail
+{
+
+class MessagePoolBase
+{
+public:
+  virtual ~MessagePoolBase() {}
+  virtual MessagePoolStats getStats() const = 0;
+};
+
+/**
+ * \brief Internal use
+ *
+ * The message pools of one nodelet, by message type.
+ */
+struct MessagePools
+{
+  typedef std::map<std::string, boost::shared_ptr<MessagePoolBase> > M_Pool;
+
+  boost::mutex mutex;
+  M_Pool pools;
+};
+
+} // namespace detail
+
+/**
+ * \brief Recycles messages of one type, so that a steady stream of them needs no allocations
+ *
+ * allocate() hands out a message that goes back to the pool, rather than being deleted, when the
+ * last shared_ptr to it is dropped, wherever that happens.  The shared_ptr's reference count is
+ * recycled along with it.  A recycled message still holds whatever it held before; in particular
+ * its vectors keep their capacity, which is what saves reallocating the data of big messages such
+ * as images.  Set every field before publishing it.
+ *
+ * At most max_free messages are kept for reuse, any more are deleted when released.  The pool's
+ * memory is freed once the pool and all the messages from it are gone.
+ */
+template<class M>
+class MessagePool : public detail::MessagePoolBase
+{
+public:
+  typedef boost::shared_ptr<MessagePool<M> > Ptr;
+
+  explicit MessagePool(uint32_t max_free = 16)
+  : storage_(new Storage(max_free))
+  {}
+
+  /// A message from the pool, or a new one if the pool is empty
+  boost::shared_ptr<M> allocate()
+  {
+    M* msg = storage_->take();
+    return boost::shared_ptr<M>(msg, Recycler(storage_), BlockAllocator<M>(storage_));
+  }
+
+  void setMaxFree(uint32_t max_free)
+  {
+    boost::mutex::scoped_lock lock(storage_->mutex);
+    storage_->max_free = max_free;
+  }
+
+  virtual MessagePoolStats getStats() const
+  {
+    MessagePoolStats stats;
+    stats.type = ros::message_traits::datatype<M>();
+    stats.hits = storage_->hits.load();
+    stats.misses = storage_->misses.load();
+    boost::mutex::scoped_lock lock(storage_->mutex);
+    stats.free = storage_->free_messages.size();
+    return stats;
+  }
+
+private:
+  // Shared by the pool and its messages, so that released messages can always find their way back
+  struct Storage
+  {
+    Storage(uint32_t max_free)
+    : max_free(max_free)
+    , block_size(0)
+    , hits(0)
+    , misses(0)
+    {}
+
+    ~Storage()
+    {
+      for (size_t i = 0; i < free_messages.size(); ++i)
+      {
+        delete free_messages[i];
+      }
+
+      for (size_t i = 0; i < free_blocks.size(); ++i)
+      {
+        ::operator delete(free_blocks[i]);
+      }
+    }
+
+    M* take()
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex);
+        if (!free_messages.empty())
+        {
+          M* msg = free_messages.back();
+          free_messages.pop_back();
+          ++hits;
+          return msg;
+        }
+      }
+
+      ++misses;
+      return new M;
+    }
+
+    void release(M* msg)
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex);
+        if (free_messages.size() < max_free)
+        {
+          free_messages.push_back(msg);
+          return;
+        }
+      }
+
+      delete msg;
+    }
+
+    // Reference count blocks all have the same size, anything else goes to the heap
+    void* takeBlock(size_t size)
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex);
+        if (block_size == 0)
+        {
+          block_size = size;
+        }
+
+        if (size == block_size && !free_blocks.empty())
+        {
+          void* block = free_blocks.back();
+          free_blocks.pop_back();
+          return block;
+        }
+      }
+
+      return ::operator new(size);
+    }
+
+    void releaseBlock(void* block, size_t size)
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex);
+        // One block per message that can be in the pool
+        if (size == block_size && free_blocks.size() < max_free)
+        {
+          free_blocks.push_back(block);
+          return;
+        }
+      }
+
+      ::operator delete(block);
+    }
+
+    boost::mutex mutex;
+    std::vector<M*> free_messages;
+    std::vector<void*> free_blocks;
+    uint32_t max_free;
+    size_t block_size;
+    boost::atomic<uint64_t> hits;
+    boost::atomic<uint64_t> misses;
+  };
+  typedef boost::shared_ptr<Storage> StoragePtr;
+
+  struct Recycler
+  {
+    Recycler(const StoragePtr& storage) : storage(storage) {}
+    void operator()(M* msg) const { storage->release(msg); }
+    StoragePtr storage;
+  };
+
+  // Lets shared_ptr take its reference count block from the pool too
+  template<class T>
+  struct BlockAllocator
+  {
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    template<class U>
+    struct rebind
+    {
+      typedef BlockAllocator<U> other;
+    };
+
+    BlockAllocator(const StoragePtr& storage) : storage(storage) {}
+    template<class U>
+    BlockAllocator(const BlockAllocator<U>& other) : storage(other.storage) {}
+
+    pointer allocate(size_type n, const void* = 0)
+    {
+      return static_cast<pointer>(storage->takeBlock(n * sizeof(T)));
+    }
+
+    void deallocate(pointer p, size_type n)
+    {
+      storage->releaseBlock(p, n * sizeof(T));
+    }
+
+    void construct(pointer p, const T& value) { new (p) T(value); }
+    void destroy(pointer p) { p->~T(); }
+    size_type max_size() const { return size_type(-1) / sizeof(T); }
+
+    bool operator==(const BlockAllocator& other) const { return storage == other.storage; }
+    bool operator!=(const BlockAllocator& other) const { return storage != other.storage; }
+
+    StoragePtr storage;
+  };
+
+  StoragePtr storage_;
+};
+
+template<class M>
+boost::shared_ptr<MessagePool<M> > Nodelet::getMessagePool() const
+{
+  detail::MessagePools& pools = getMessagePools();
+  boost::mutex::scoped_lock lock(pools.mutex);
+  boost::shared_ptr<detail::MessagePoolBase>& pool = pools.pools[typeid(M).name()];
+  if (!pool)
+  {
+    pool.reset(new MessagePool<M>);
+  }
+
+  return boost::static_pointer_cast<MessagePool<M> >(pool);
+}
+
+template<class M>
+boost::shared_ptr<M> Nodelet::allocateMessage() const
+{
+  return getMessagePool<M>()->allocate();
+}
+
+} // namespace nodelet
+
+#endif // NODELET_MESSAGE_POOL_H
@@ -37,6 +37,8 @@
 #include <map>
 
 #include <ros/console.h>
+#include <ros/time.h>
+#include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
 
 namespace ros
@@ -45,6 +47,11 @@ class NodeHandle;
 class CallbackQueueInterface;
 }
 
+namespace XmlRpc
+{
+class XmlRpcValue;
+}
+
 #define NODELET_DEBUG(...) ROS_DEBUG_NAMED(getName(), __VA_ARGS__)
 #define NODELET_DEBUG_STREAM(...) ROS_DEBUG_STREAM_NAMED(getName(), __VA_ARGS__)
 #define NODELET_DEBUG_ONCE(...) ROS_DEBUG_ONCE_NAMED(getName(), __VA_ARGS__)
@@ -162,6 +169,24 @@ typedef boost::shared_ptr<ros::NodeHandle> NodeHandlePtr;
 typedef std::map<std::string, std::string> M_string;
 typedef std::vector<std::string> V_string;
 
+template<class M> class LocalPublisher;
+class LocalSubscriber;
+template<class M> class MessagePool;
+
+namespace detail
+{
+struct MessagePools;
+}
+
+/// How well a MessagePool is doing, from Nodelet::getMessagePoolStats()
+struct MessagePoolStats
+{
+  std::string type;
+  uint64_t hits;   ///<! Messages handed out from the pool
+  uint64_t misses; ///<! Messages that had to be allocated because the pool was empty
+  uint32_t free;   ///<! Messages in the pool now
+};
+
 class UninitializedException : public Exception
 {
 public:
@@ -197,6 +222,71 @@ protected:
   ros::CallbackQueueInterface& getSTCallbackQueue() const;
   ros::CallbackQueueInterface& getMTCallbackQueue() const;
 
+  /**\brief How long the callback being executed in this thread waited in its queue
+   *
+   * Measured from when the callback was queued to when it was called, so it does not include
+   * any time spent in the callback itself.  A nodelet can use this to notice it is falling behind
+   * and shed work.  Zero when not called from a callback, e.g. from onInit().
+   */
+  static ros::WallDuration getCurrentCallbackQueueLatency();
+
+  /**\brief Get a private parameter of this nodelet, from the parameters it was loaded with if any
+   *
+   * Reading from the parameters in the load request saves asking the master, which onInit()
+   * otherwise does for every parameter.  Falls back to the private NodeHandle for keys that
+   * aren't in there.  The key is relative to the private namespace, e.g. "filter/size"; absolute
+   * keys always go to the NodeHandle.
+   */
+  bool getLocalParam(const std::string& key, std::string& value) const;
+  bool getLocalParam(const std::string& key, double& value) const;
+  bool getLocalParam(const std::string& key, int& value) const;
+  bool getLocalParam(const std::string& key, bool& value) const;
+  bool getLocalParam(const std::string& key, XmlRpc::XmlRpcValue& value) const;
+
+  /**\brief Like getLocalParam(), but set value to default_value if the parameter isn't found */
+  template<typename T>
+  void localParam(const std::string& key, T& value, const T& default_value) const
+  {
+    if (!getLocalParam(key, value))
+    {
+      value = default_value;
+    }
+  }
+
+  /**\brief Advertise a topic whose subscribers in this process get messages by pointer
+   *
+   * Use with subscribeLocal().  Subscribers in other managers on this host get messages through
+   * shared memory, anyone else over ROS.  See LocalPublisher; include nodelet/local_channel.h to
+   * use this.
+   */
+  template<class M>
+  LocalPublisher<M> advertiseLocal(ros::NodeHandle& nh, const std::string& topic, uint32_t queue_size) const;
+
+  /**\brief Subscribe to a topic, receiving messages from advertiseLocal() publishers in this process by pointer
+   *
+   * Callbacks run from nh's callback queue.  Messages from other processes arrive over ROS as
+   * usual.  See LocalSubscriber; include nodelet/local_channel.h to use this.
+   */
+  template<class M>
+  LocalSubscriber subscribeLocal(ros::NodeHandle& nh, const std::string& topic, uint32_t queue_size,
+                                 const boost::function<void (const boost::shared_ptr<const M>&)>& callback) const;
+  template<class M, class T>
+  LocalSubscriber subscribeLocal(ros::NodeHandle& nh, const std::string& topic, uint32_t queue_size,
+                                 void (T::*fp)(const boost::shared_ptr<const M>&), T* obj) const;
+
+  /**\brief This nodelet's pool of messages of type M, created on first use
+   *
+   * Take messages to publish from it, rather than allocating them, so that they are recycled once
+   * all subscribers are done with them.  See MessagePool; include nodelet/message_pool.h to use this.
+   * Looking the pool up takes a lock, so keep the pointer for use in callbacks.
+   */
+  template<class M>
+  boost::shared_ptr<MessagePool<M> > getMessagePool() const;
+
+  /**\brief A message from getMessagePool<M>(), with the contents it had when it was last released */
+  template<class M>
+  boost::shared_ptr<M> allocateMessage() const;
+
 
   // Internal storage;
 private:
@@ -210,6 +300,14 @@ private:
   NodeHandlePtr mt_private_nh_;
   V_string my_argv_;
 
+  // Everything added since, so that adding more doesn't change the layout of Nodelet again
+  struct Impl;
+  boost::shared_ptr<Impl> impl_;
+
+  // Parameter key in the parameters from init(), or NULL
+  XmlRpc::XmlRpcValue* findLocalParam(const std::string& key) const;
+  detail::MessagePools& getMessagePools() const;
+
   // Method to be overridden by subclass when starting up.
   virtual void onInit() = 0;
 
@@ -227,6 +325,16 @@ public:
             ros::CallbackQueueInterface* st_queue = NULL,
             ros::CallbackQueueInterface* mt_queue = NULL);
 
+  /**\brief Init function called at startup, with the private parameters of this nodelet for getLocalParam()
+   * \param params The private parameters, NULL if not known
+   */
+  void init(const std::string& name, const M_string& remapping_args, const V_string& my_argv,
+            ros::CallbackQueueInterface* st_queue, ros::CallbackQueueInterface* mt_queue,
+            const XmlRpc::XmlRpcValue* params);
+
+  /**\brief Hits and misses of each of the nodelet's message pools, see getMessagePool() */
+  std::vector<MessagePoolStats> getMessagePoolStats() const;
+
   virtual ~Nodelet();
 };
 
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2010, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Replaces the global operator new and delete in the nodelet executable, to charge allocations to
+// the nodelet running on the thread when NODELET_MEMORY_ACCOUNTING is set.  See MemoryAccount.
+
+#include <nodelet/detail/memory_accounting.h>
+
+#include <limits>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+using nodelet::detail::MemoryAccount;
+
+// Dynamic exception specifications are gone in C++17
+#if __cplusplus >= 201103L
+#define NODELET_THROWS_BAD_ALLOC
+#define NODELET_NOTHROW noexcept
+#else
+#define NODELET_THROWS_BAD_ALLOC throw(std::bad_alloc)
+#define NODELET_NOTHROW throw()
+#endif
+
+namespace
+{
+
+// Keeps the memory after it aligned like malloc()'s
+struct Header
+{
+  MemoryAccount* account;
+  size_t size;
+};
+
+// Decided on the first allocation and never changed, since delete has to know whether there is a header
+int g_accounting = -1;
+
+inline bool accounting()
+{
+  if (g_accounting < 0)
+  {
+    const char* env = getenv("NODELET_MEMORY_ACCOUNTING");
+    g_accounting = (env && *env && strcmp(env, "0") != 0) ? 1 : 0;
+    if (g_accounting)
+    {
+      nodelet::detail::enableMemoryAccounting();
+    }
+  }
+  return g_accounting == 1;
+}
+
+void* allocate(size_t size)
+{
+  if (size == 0)
+  {
+    size = 1;
+  }
+
+  if (!accounting())
+  {
+    return malloc(size);
+  }
+
+  // The header mustn't wrap the size around to a small allocation
+  if (size > std::numeric_limits<size_t>::max() - sizeof(Header))
+  {
+    return NULL;
+  }
+
+  Header* header = static_cast<Header*>(malloc(sizeof(Header) + size));
+  if (!header)
+  {
+    return NULL;
+  }
+
+  header->account = nodelet::detail::getCurrentMemoryAccount();
+  header->size = size;
+  if (header->account)
+  {
+    header->account->live_bytes += size;
+    header->account->allocations++;
+    header->account->allocated_bytes += size;
+    header->account->references++;
+  }
+  return header + 1;
+}
+
+void release(void* ptr)
+{
+  if (!ptr)
+  {
+    return;
+  }
+
+  if (!accounting())
+  {
+    free(ptr);
+    return;
+  }
+
+  Header* header = static_cast<Header*>(ptr) - 1;
+  if (header->account)
+  {
+    header->account->live_bytes -= header->size;
+    nodelet::detail::releaseMemoryAccount(header->account);
+  }
+  free(header);
+}
+
+void* allocateOrThrow(size_t size)
+{
+  for (;;)
+  {
+    void* ptr = allocate(size);
+    if (ptr)
+    {
+      return ptr;
+    }
+
+    std::new_handler handler = std::set_new_handler(NULL);
+    std::set_new_handler(handler);
+    if (!handler)
+    {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+} // namespace
+
+void* operator new(size_t size) NODELET_THROWS_BAD_ALLOC
+{
+  return allocateOrThrow(size);
+}
+
+void* operator new[](size_t size) NODELET_THROWS_BAD_ALLOC
+{
+  return allocateOrThrow(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) NODELET_NOTHROW
+{
+  return allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) NODELET_NOTHROW
+{
+  return allocate(size);
+}
+
+void operator delete(void* ptr) NODELET_NOTHROW
+{
+  release(ptr);
+}
+
+void operator delete[](void* ptr) NODELET_NOTHROW
+{
+  release(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) NODELET_NOTHROW
+{
+  release(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) NODELET_NOTHROW
+{
+  release(ptr);
+}
@@ -29,53 +29,636 @@
 
 #include <nodelet/detail/callback_queue.h>
 #include <nodelet/detail/callback_queue_manager.h>
+#include <nodelet/detail/memory_accounting.h>
 
 #include <ros/callback_queue.h>
+#include <ros/console.h>
+
+#include <boost/thread/thread.hpp>
+
+#include <time.h>
 
 namespace nodelet
 {
 namespace detail
 {
 
-CallbackQueue::CallbackQueue(CallbackQueueManager* parent,
-                             const ros::VoidConstPtr& tracked_object)
+boost::thread_specific_ptr<CallbackQueue::CurrentCall> CallbackQueue::current_call_;
+
+CallbackQueue::CurrentCall& CallbackQueue::currentCall()
+{
+  CurrentCall* current = current_call_.get();
+  if (!current)
+  {
+    current = new CurrentCall;
+    current_call_.reset(current);
+  }
+  return *current;
+}
+
+ros::WallDuration CallbackQueue::getCurrentLatency()
+{
+  CurrentCall* current = current_call_.get();
+  if (!current || !current->id_info)
+  {
+    return ros::WallDuration();
+  }
+  return current->latency;
+}
+
+CallbackQueue::CallbackQueue(CallbackQueueManager* parent)
 : parent_(parent)
-, tracked_object_(tracked_object)
-, has_tracked_object_(tracked_object)
+, enabled_(true)
+, head_(&stub_)
+, tail_(&stub_)
+, size_(0)
+, max_size_(0)
+, overflow_policy_(DropOldest)
+, dropped_(0)
+, latency_count_(0)
+, latency_total_ns_(0)
+, latency_max_ns_(0)
+, cpu_ns_(0)
+, discard_before_ns_(0)
+, memory_account_(NULL)
+, blocked_producers_(0)
 {
+  for (size_t i = 0; i < ID_INFO_CACHE_SIZE; ++i)
+  {
+    id_info_cache_[i].store(0, boost::memory_order_relaxed);
+  }
 }
 
 CallbackQueue::~CallbackQueue()
 {
+  while (Node* node = pop())
+  {
+    delete node;
+  }
+
+  for (M_IDInfo::iterator it = id_info_.begin(); it != id_info_.end(); ++it)
+  {
+    delete it->second;
+  }
+}
+
+void CallbackQueue::disable()
+{
+  enabled_.store(false);
+
+  // Nobody is going to make room for blocked producers any more
+  boost::mutex::scoped_lock lock(space_mutex_);
+  space_cond_.notify_all();
+}
+
+bool CallbackQueue::isEnabled()
+{
+  return enabled_.load();
+}
+
+void CallbackQueue::discardAddedBefore(const ros::WallTime& stamp)
+{
+  discard_before_ns_.store(stamp.toNSec());
+}
+
+void CallbackQueue::setMaxSize(uint32_t max_size, OverflowPolicy policy)
+{
+  overflow_policy_.store(policy);
+  max_size_.store(max_size);
+
+  // Producers blocked under the old limit may be able to proceed now
+  boost::mutex::scoped_lock lock(space_mutex_);
+  space_cond_.notify_all();
+}
+
+uint32_t CallbackQueue::getMaxSize()
+{
+  return max_size_.load();
+}
+
+CallbackQueue::OverflowPolicy CallbackQueue::getOverflowPolicy()
+{
+  return overflow_policy_.load();
+}
+
+size_t CallbackQueue::size()
+{
+  return size_.load();
+}
+
+uint64_t CallbackQueue::getDroppedCount()
+{
+  return dropped_.load();
+}
+
+ros::WallDuration CallbackQueue::getCPUTime()
+{
+  ros::WallDuration cpu;
+  cpu.fromNSec(cpu_ns_.load());
+  return cpu;
+}
+
+void CallbackQueue::setMemoryAccount(MemoryAccount* account)
+{
+  memory_account_ = account;
+}
+
+// CPU time used by the calling thread so far
+static uint64_t threadCPUNSec()
+{
+  timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+  {
+    return 0;
+  }
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+CallbackQueue::LatencyStats CallbackQueue::getLatencyStats()
+{
+  LatencyStats stats;
+  stats.count = latency_count_.load();
+  stats.total.fromNSec(latency_total_ns_.load());
+  stats.max.fromNSec(latency_max_ns_.load());
+  return stats;
+}
+
+CallbackQueue::IDInfo* CallbackQueue::getIDInfo(uint64_t owner_id)
+{
+  // Owner ids are mostly addresses, so mix in the bits above the alignment
+  size_t slot = (size_t)(owner_id ^ (owner_id >> 4) ^ (owner_id >> 12)) % ID_INFO_CACHE_SIZE;
+  IDInfo* id_info = id_info_cache_[slot].load(boost::memory_order_acquire);
+  if (id_info && id_info->id == owner_id)
+  {
+    return id_info;
+  }
+
+  {
+    boost::mutex::scoped_lock lock(id_info_mutex_);
+    IDInfo*& entry = id_info_[owner_id];
+    if (!entry)
+    {
+      entry = new IDInfo(owner_id);
+    }
+    id_info = entry;
+  }
+
+  id_info_cache_[slot].store(id_info, boost::memory_order_release);
+  return id_info;
+}
+
+bool CallbackQueue::removed(const Node* node)
+{
+  return IDInfo::generation(node->id_info->pending.load()) != node->generation;
+}
+
+bool CallbackQueue::reserve(uint32_t max_size)
+{
+  uint32_t size = size_.load(boost::memory_order_relaxed);
+  do
+  {
+    if (size >= max_size)
+    {
+      return false;
+    }
+  }
+  while (!size_.compare_exchange_weak(size, size + 1));
+
+  return true;
+}
+
+bool CallbackQueue::reserveBlocking(uint32_t max_size)
+{
+  bool reserved = false;
+  ++blocked_producers_;
+  {
+    boost::mutex::scoped_lock lock(space_mutex_);
+    while (enabled_.load())
+    {
+      if (max_size == 0)
+      {
+        ++size_;
+        reserved = true;
+        break;
+      }
+
+      if (reserve(max_size))
+      {
+        reserved = true;
+        break;
+      }
+
+      space_cond_.wait(lock);
+      max_size = max_size_.load();
+    }
+  }
+  --blocked_producers_;
+
+  return reserved;
+}
+
+void CallbackQueue::recordLatency(const ros::WallDuration& latency)
+{
+  uint64_t ns = latency.toNSec() > 0 ? latency.toNSec() : 0;
+  ++latency_count_;
+  latency_total_ns_ += ns;
+
+  uint64_t max = latency_max_ns_.load(boost::memory_order_relaxed);
+  while (ns > max && !latency_max_ns_.compare_exchange_weak(max, ns))
+  {
+  }
+}
+
+void CallbackQueue::released(uint32_t count)
+{
+  size_ -= count;
+  if (blocked_producers_.load() > 0)
+  {
+    boost::mutex::scoped_lock lock(space_mutex_);
+    space_cond_.notify_all();
+  }
+}
+
+bool CallbackQueue::track(Node* node)
+{
+  // Paired with removeByID(): either the node is counted in pending before the owner is removed,
+  // and released by removeByID(), or it sees the owner's generation has moved on.
+  boost::atomic<uint64_t>& pending = node->id_info->pending;
+  uint64_t value = pending.load();
+  do
+  {
+    if (IDInfo::generation(value) != node->generation)
+    {
+      return false;
+    }
+  }
+  while (!pending.compare_exchange_weak(value, value + 1));
+
+  return true;
+}
+
+bool CallbackQueue::untrack(Node* node)
+{
+  // A node that was still counted when its owner was removed has already been released
+  boost::atomic<uint64_t>& pending = node->id_info->pending;
+  uint64_t value = pending.load();
+  do
+  {
+    if (IDInfo::generation(value) != node->generation)
+    {
+      return false;
+    }
+  }
+  while (!pending.compare_exchange_weak(value, value - 1));
+
+  return true;
+}
+
+void CallbackQueue::push(Node* node)
+{
+  node->next.store(0, boost::memory_order_relaxed);
+  Node* prev = head_.exchange(node, boost::memory_order_acq_rel);
+  prev->next.store(node, boost::memory_order_release);
+}
+
+CallbackQueue::Node* CallbackQueue::pop()
+{
+  Node* tail = tail_;
+  Node* next = tail->next.load(boost::memory_order_acquire);
+  if (tail == &stub_)
+  {
+    if (!next)
+    {
+      return 0;
+    }
+
+    tail_ = next;
+    tail = next;
+    next = next->next.load(boost::memory_order_acquire);
+  }
+
+  if (next)
+  {
+    tail_ = next;
+    return tail;
+  }
+
+  // tail is the last linked node.  If head_ has moved past it a producer is between its exchange
+  // and its link, and tail can't be unlinked until that finishes.
+  if (tail != head_.load(boost::memory_order_acquire))
+  {
+    return 0;
+  }
+
+  push(&stub_);
+  next = tail->next.load(boost::memory_order_acquire);
+  if (next)
+  {
+    tail_ = next;
+    return tail;
+  }
+
+  return 0;
+}
+
+CallbackQueue::Node* CallbackQueue::unlinkOldest(uint64_t owner_id)
+{
+  // A node whose next pointer is set will never be written to by a producer again, so it can be
+  // unlinked by rewriting its predecessor.  The last node stays put.
+  Node* prev = 0;
+  Node* node = tail_;
+  while (Node* next = node->next.load(boost::memory_order_acquire))
+  {
+    if (node != &stub_ && node->id_info->id == owner_id && !removed(node))
+    {
+      if (prev)
+      {
+        prev->next.store(next, boost::memory_order_relaxed);
+      }
+      else
+      {
+        tail_ = next;
+      }
+      return node;
+    }
+
+    prev = node;
+    node = next;
+  }
+
+  return 0;
 }
 
 void CallbackQueue::addCallback(const ros::CallbackInterfacePtr& cb, uint64_t owner_id)
 {
-  if (queue_.isEnabled())
+  if (!enabled_.load(boost::memory_order_relaxed))
   {
-    queue_.addCallback(cb, owner_id);
-    parent_->callbackAdded(shared_from_this());
+    return;
+  }
+
+  Node* node = new Node;
+  node->callback = cb;
+  node->id_info = getIDInfo(owner_id);
+  node->generation = IDInfo::generation(node->id_info->pending.load());
+  node->stamp = ros::WallTime::now();
+
+  uint32_t max_size = max_size_.load(boost::memory_order_relaxed);
+  if (max_size == 0)
+  {
+    ++size_;
+  }
+  else if (!reserve(max_size))
+  {
+    OverflowPolicy policy = overflow_policy_.load();
+    if (policy == Block && currentCall().id_info)
+    {
+      policy = DropNewest;
+    }
+
+    // Every linked node has one outstanding CallbackQueueManager::callbackAdded() notification.
+    // A node that replaces an evicted one inherits the evicted node's notification.
+    Node* evicted = 0;
+    switch (policy)
+    {
+    case Block:
+      if (!reserveBlocking(max_size))
+      {
+        delete node;
+        return;
+      }
+      break;
+    case DropOldest:
+      {
+        // Tombstones left behind by removeByID() hold no slot, so evicting one frees nothing
+        boost::mutex::scoped_lock lock(consumer_mutex_);
+        while ((evicted = pop()) && removed(evicted))
+        {
+          untrack(evicted);
+          delete evicted;
+        }
+      }
+      break;
+    case Coalesce:
+      {
+        boost::mutex::scoped_lock lock(consumer_mutex_);
+        evicted = unlinkOldest(owner_id);
+      }
+
+      if (evicted)
+      {
+        break;
+      }
+      // No pending callback to coalesce with; fall through and drop this one
+    case DropNewest:
+      ++dropped_;
+      delete node;
+      return;
+    }
+
+    if (evicted)
+    {
+      // The new node takes over the evicted node's slot, unless its owner was removed meanwhile
+      // and the slot was released already.
+      if (untrack(evicted))
+      {
+        ++dropped_;
+      }
+      else
+      {
+        ++size_;
+      }
+      delete evicted;
+
+      if (track(node))
+      {
+        push(node);
+      }
+      else
+      {
+        released(1);
+        delete node;
+      }
+      return;
+    }
+
+    if (policy != Block)
+    {
+      // A producer was mid-push, so nothing could be evicted.  Go over the limit by one rather
+      // than wait for it.
+      ++size_;
+    }
+  }
+
+  if (!track(node))
+  {
+    // The owner was removed while we were adding
+    released(1);
+    delete node;
+    return;
+  }
+
+  push(node);
+
+  if (parent_)
+  {
+    parent_->callbackAdded(this);
   }
 }
 
 void CallbackQueue::removeByID(uint64_t owner_id)
 {
-  queue_.removeByID(owner_id);
+  IDInfo* id_info;
+  {
+    boost::mutex::scoped_lock lock(id_info_mutex_);
+    M_IDInfo::iterator it = id_info_.find(owner_id);
+    if (it == id_info_.end())
+    {
+      return;
+    }
+
+    id_info = it->second;
+  }
+
+  // Retire the owner's pending callbacks without touching them.  They stay linked as tombstones
+  // until callOne() reaches and discards them, but stop counting towards the queue size now.
+  // Callbacks added from here on belong to the next generation.
+  uint64_t value = id_info->pending.load();
+  while (!id_info->pending.compare_exchange_weak(value, (uint64_t)(IDInfo::generation(value) + 1) << 32))
+  {
+  }
+  uint32_t pending = IDInfo::count(value);
+  if (pending > 0)
+  {
+    released(pending);
+  }
+
+  // Wait for in-progress calls from this owner to finish.  If we're being called from within one of
+  // them, stop counting ourselves while we wait so that concurrent self-removals can't deadlock.
+  bool from_own_callback = (currentCall().id_info == id_info);
+  if (from_own_callback)
+  {
+    --id_info->calling;
+  }
+
+  for (uint32_t spins = 0; id_info->calling.load() > 0; ++spins)
+  {
+    if (spins < 100)
+    {
+      boost::this_thread::yield();
+    }
+    else
+    {
+      boost::this_thread::sleep(boost::posix_time::microseconds(100));
+    }
+  }
+
+  if (from_own_callback)
+  {
+    ++id_info->calling;
+  }
 }
 
 uint32_t CallbackQueue::callOne()
 {
-  // Don't try to call the callback after its nodelet has been destroyed!
-  ros::VoidConstPtr tracker;
-  if (has_tracked_object_)
+  // Don't try to call the callback after its nodelet has been removed!
+  if (!enabled_.load())
   {
-    tracker = tracked_object_.lock();
+    return ros::CallbackQueue::Disabled;
+  }
+
+  Node* node = 0;
+  for (;;)
+  {
+    {
+      boost::mutex::scoped_lock lock(consumer_mutex_);
+      node = pop();
+    }
+
+    if (!node)
+    {
+      // Nodes that are reserved but not linked yet will be announced by their producer
+      return size_.load() > 0 ? ros::CallbackQueue::TryAgain : ros::CallbackQueue::Empty;
+    }
+
+    if (!untrack(node))
+    {
+      // Tombstone left behind by removeByID()
+      delete node;
+      continue;
+    }
+
+    if (node->stamp.toNSec() < discard_before_ns_.load(boost::memory_order_relaxed))
+    {
+      released(1);
+      delete node;
+      continue;
+    }
 
-    if (!tracker)
-      return ros::CallbackQueue::Disabled;
+    if (node->callback->ready())
+    {
+      break;
+    }
+
+    if (track(node))
+    {
+      push(node);
+      return ros::CallbackQueue::TryAgain;
+    }
+
+    released(1);
+    delete node;
   }
-  
-  return queue_.callOne();
+
+  released(1);
+
+  ros::WallDuration latency = ros::WallTime::now() - node->stamp;
+  recordLatency(latency);
+
+  // Paired with removeByID(), which moves the generation on before waiting for calling to drop to zero
+  ros::CallbackInterface::CallResult result = ros::CallbackInterface::Invalid;
+  IDInfo* id_info = node->id_info;
+  ++id_info->calling;
+  if (!removed(node))
+  {
+    CurrentCall& current = currentCall();
+    CurrentCall outer = current;
+    current.id_info = id_info;
+    current.latency = latency;
+    MemoryAccountScope account_scope(memory_account_);
+    uint64_t cpu_start = threadCPUNSec();
+    try
+    {
+      result = node->callback->call();
+    }
+    catch (...)
+    {
+      // Undo everything removeByID() and later calls on this thread depend on before unwinding
+      ROS_ERROR("Exception thrown from a nodelet callback");
+      cpu_ns_ += threadCPUNSec() - cpu_start;
+      current = outer;
+      --id_info->calling;
+      delete node;
+      throw;
+    }
+    cpu_ns_ += threadCPUNSec() - cpu_start;
+    current = outer;
+  }
+  --id_info->calling;
+
+  if (result == ros::CallbackInterface::TryAgain)
+  {
+    // Put it back even if the queue has filled up meanwhile; it was already accounted for
+    ++size_;
+    if (track(node))
+    {
+      push(node);
+      return ros::CallbackQueue::TryAgain;
+    }
+    released(1);
+  }
+
+  delete node;
+  return ros::CallbackQueue::Called;
 }
 
 } // namespace detail
@@ -44,7 +44,8 @@ namespace detail
 {
 
 CallbackQueueManager::CallbackQueueManager(uint32_t num_worker_threads)
-: running_(true),
+: quiescent_waiters_(0),
+  running_(true),
   num_worker_threads_(num_worker_threads)
 {
   if (num_worker_threads_ == 0)
@@ -56,7 +57,8 @@ CallbackQueueManager::CallbackQueueManager(uint32_t num_worker_threads)
   thread_info_.reset( new ThreadInfo[num_threads] );
   for (size_t i = 0; i < num_threads; ++i)
   {
-    tg_.create_thread(boost::bind(&CallbackQueueManager::workerThread, this, &thread_info_[i]));
+    boost::thread* thread = tg_.create_thread(boost::bind(&CallbackQueueManager::workerThread, this, &thread_info_[i]));
+    thread_info_[i].id = thread->get_id();
   }
 }
 
@@ -99,6 +101,11 @@ void CallbackQueueManager::stop()
     thread_info_[i].queue_cond.notify_all();
   }
 
+  {
+    boost::mutex::scoped_lock lock(quiescent_mutex_);
+    quiescent_cond_.notify_all();
+  }
+
   tg_.join_all();
 }
 
@@ -107,7 +114,7 @@ uint32_t CallbackQueueManager::getNumWorkerThreads()
   return num_worker_threads_;
 }
 
-void CallbackQueueManager::addQueue(const CallbackQueuePtr& queue, bool threaded)
+void CallbackQueueManager::addQueue(const CallbackQueuePtr& queue, bool threaded, bool paused)
 {
   boost::mutex::scoped_lock lock(queues_mutex_);
 
@@ -116,17 +123,121 @@ void CallbackQueueManager::addQueue(const CallbackQueuePtr& queue, bool threaded
   info.reset(new QueueInfo);
   info->queue = queue;
   info->threaded = threaded;
+  info->paused = paused;
+}
+
+void CallbackQueueManager::resumeQueue(const CallbackQueuePtr& queue)
+{
+  uint32_t deferred = 0;
+  {
+    boost::mutex::scoped_lock lock(queues_mutex_);
+    M_Queue::iterator it = queues_.find(queue.get());
+    if (it == queues_.end())
+    {
+      // Removed meanwhile
+      return;
+    }
+
+    it->second->paused = false;
+    std::swap(deferred, it->second->deferred);
+  }
+
+  if (deferred > 0)
+  {
+    {
+      boost::mutex::scoped_lock lock(waiting_mutex_);
+      waiting_.insert(waiting_.end(), deferred, queue.get());
+    }
+    waiting_cond_.notify_all();
+  }
+}
+
+int32_t CallbackQueueManager::getQueueThread(const CallbackQueuePtr& queue)
+{
+  QueueInfoPtr info;
+  {
+    boost::mutex::scoped_lock lock(queues_mutex_);
+    M_Queue::iterator it = queues_.find(queue.get());
+    if (it == queues_.end())
+    {
+      return -1;
+    }
+    info = it->second;
+  }
+
+  if (info->threaded)
+  {
+    return -1;
+  }
+
+  boost::mutex::scoped_lock lock(info->st_mutex);
+  return info->in_thread > 0 ? (int32_t)info->thread_index : -1;
 }
 
 void CallbackQueueManager::removeQueue(const CallbackQueuePtr& queue)
 {
-  boost::mutex::scoped_lock lock(queues_mutex_);
-  ROS_ASSERT(queues_.find(queue.get()) != queues_.end());
+  // From here on callOne() refuses to call anything, but a worker may be inside it already
+  queue->disable();
+
+  QueueInfoPtr info;
+  {
+    boost::mutex::scoped_lock lock(queues_mutex_);
+    M_Queue::iterator it = queues_.find(queue.get());
+    ROS_ASSERT(it != queues_.end());
 
-  queues_.erase(queue.get());
+    info = it->second;
+    queues_.erase(it);
+  }
+
+  // The manager thread only dispatches queues it finds in queues_, so the only references left are
+  // in the worker threads.  Drop the ones that haven't been picked up yet, and let every worker in
+  // the middle of a batch release the queue once its batch is done.
+  for (size_t i = 0; i < num_worker_threads_; ++i)
+  {
+    ThreadInfo& ti = thread_info_[i];
+    boost::mutex::scoped_lock lock(ti.queue_mutex);
+    V_QueueInfo::iterator it = ti.queue.begin();
+    while (it != ti.queue.end())
+    {
+      if (*it == info.get())
+      {
+        it = ti.queue.erase(it);
+        --ti.calling;
+      }
+      else
+      {
+        ++it;
+      }
+    }
+
+    if (ti.epoch.load() & 1)
+    {
+      ti.retired.push_back(info);
+    }
+  }
+
+  // Wait for the workers inside callOne() on this queue, unless we're inside one of the queue's own
+  // callbacks.  That callback is still running, which the caller has to cope with.
+  ThreadInfo* self = getCurrentThreadInfo();
+  ++quiescent_waiters_;
+  for (size_t i = 0; i < num_worker_threads_; ++i)
+  {
+    ThreadInfo& ti = thread_info_[i];
+    if (&ti == self)
+    {
+      continue;
+    }
+
+    boost::mutex::scoped_lock lock(quiescent_mutex_);
+    while (ti.current.load() == info.get() && running_)
+    {
+      quiescent_cond_.wait(lock);
+    }
+  }
+  --quiescent_waiters_;
 }
 
-void CallbackQueueManager::callbackAdded(const CallbackQueuePtr& queue)
+void CallbackQueueManager::callbackAdded(CallbackQueue* queue)
 {
   {
     boost::mutex::scoped_lock lock(waiting_mutex_);
@@ -136,6 +247,20 @@ void CallbackQueueManager::callbackAdded(const CallbackQueuePtr& queue)
   waiting_cond_.notify_all();
 }
 
+CallbackQueueManager::ThreadInfo* CallbackQueueManager::getCurrentThreadInfo()
+{
+  boost::thread::id id = boost::this_thread::get_id();
+  for (size_t i = 0; i < num_worker_threads_; ++i)
+  {
+    if (thread_info_[i].id == id)
+    {
+      return &thread_info_[i];
+    }
+  }
+
+  return 0;
+}
+
 CallbackQueueManager::ThreadInfo* CallbackQueueManager::getSmallestQueue()
 {
   size_t smallest = std::numeric_limits<size_t>::max();
@@ -189,10 +314,14 @@ void CallbackQueueManager::managerThread()
       V_Queue::iterator end = local_waiting.end();
       for (; it != end; ++it)
       {
-        CallbackQueuePtr& queue = *it;
+        CallbackQueue* queue = *it;
 
-        M_Queue::iterator it = queues_.find(queue.get());
-        if (it != queues_.end())
+        M_Queue::iterator it = queues_.find(queue);
+        if (it != queues_.end() && it->second->paused)
+        {
+          ++it->second->deferred;
+        }
+        else if (it != queues_.end())
         {
           QueueInfoPtr& info = it->second;
           ThreadInfo* ti = 0;
@@ -223,7 +352,7 @@ void CallbackQueueManager::managerThread()
 
           {
             boost::mutex::scoped_lock lock(ti->queue_mutex);
-            ti->queue.push_back(std::make_pair(queue, info));
+            ti->queue.push_back(info.get());
             ++ti->calling;
 #ifdef NODELET_QUEUE_DEBUG
             double stamp = ros::WallTime::now().toSec();
@@ -243,7 +372,7 @@ void CallbackQueueManager::managerThread()
 
 void CallbackQueueManager::workerThread(ThreadInfo* info)
 {
-  std::vector<std::pair<CallbackQueuePtr, QueueInfoPtr> > local_queues;
+  V_QueueInfo local_queues;
 
   while (running_)
   {
@@ -260,16 +389,31 @@ void CallbackQueueManager::workerThread(ThreadInfo* info)
         return;
       }
 
+      // Enter the batch while still holding queue_mutex, so that removeQueue() either purges its
+      // queue from info->queue before we take it or sees that we're busy.
+      ++info->epoch;
       info->queue.swap(local_queues);
     }
 
-    std::vector<std::pair<CallbackQueuePtr, QueueInfoPtr> >::iterator it = local_queues.begin();
-    std::vector<std::pair<CallbackQueuePtr, QueueInfoPtr> >::iterator end = local_queues.end();
+    V_QueueInfo::iterator it = local_queues.begin();
+    V_QueueInfo::iterator end = local_queues.end();
     for (; it != end; ++it)
     {
-      CallbackQueuePtr& queue = it->first;
-      QueueInfoPtr& qi = it->second;
-      if (queue->callOne() == ros::CallbackQueue::TryAgain)
+      QueueInfo* qi = *it;
+      CallbackQueue* queue = qi->queue.get();
+
+      // Sequentially consistent, paired with removeQueue() disabling the queue before it looks at
+      // current: either callOne() sees the queue disabled or removeQueue() waits for us.
+      info->current.store(qi);
+      uint32_t result = queue->callOne();
+      info->current.store(0);
+      if (quiescent_waiters_.load() > 0)
+      {
+        boost::mutex::scoped_lock lock(quiescent_mutex_);
+        quiescent_cond_.notify_all();
+      }
+
+      if (result == ros::CallbackQueue::TryAgain)
       {
         callbackAdded(queue);
       }
@@ -284,6 +428,14 @@ void CallbackQueueManager::workerThread(ThreadInfo* info)
 
     local_queues.clear();
 
+    // Leave the batch under queue_mutex, so that removeQueue() hands us queues to release only while
+    // we may still refer to them
+    V_QueueInfoPtr retired;
+    {
+      boost::mutex::scoped_lock lock(info->queue_mutex);
+      ++info->epoch;
+      retired.swap(info->retired);
+    }
   }
 }
 
@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2010, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <nodelet/detail/class_index.h>
+
+#include <ros/console.h>
+
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <dirent.h>
+#include <set>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nodelet
+{
+namespace detail
+{
+
+static const char* const INDEX_MAGIC = "nodelet_index";
+static const int INDEX_VERSION = 2;
+
+ClassIndex::ClassIndex(const std::string& path)
+: path_(path.empty() ? getDefaultPath() : path)
+{
+}
+
+std::string ClassIndex::getDefaultPath()
+{
+  std::string ros_home;
+  if (const char* env = getenv("ROS_HOME"))
+  {
+    ros_home = env;
+  }
+  else if (const char* home = getenv("HOME"))
+  {
+    ros_home = std::string(home) + "/.ros";
+  }
+  else
+  {
+    return std::string();
+  }
+
+  return ros_home + "/nodelet_index";
+}
+
+bool ClassIndex::stat(const std::string& path, File& file)
+{
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0)
+  {
+    return false;
+  }
+
+  file.path = path;
+  file.mtime = st.st_mtime;
+  file.size = st.st_size;
+  return true;
+}
+
+std::string ClassIndex::findManifest(const std::string& plugin_xml)
+{
+  std::string dir = plugin_xml;
+  std::string::size_type slash;
+  while ((slash = dir.rfind('/')) != std::string::npos && slash > 0)
+  {
+    dir.erase(slash);
+
+    const char* names[] = { "/package.xml", "/manifest.xml" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    {
+      std::string manifest = dir + names[i];
+      if (access(manifest.c_str(), F_OK) == 0)
+      {
+        return manifest;
+      }
+    }
+  }
+
+  return std::string();
+}
+
+std::vector<std::string> ClassIndex::getPackagePathRoots()
+{
+  std::vector<std::string> roots;
+  if (const char* env = getenv("ROS_PACKAGE_PATH"))
+  {
+    std::string package_path(env);
+    boost::split(roots, package_path, boost::is_any_of(":"));
+  }
+
+  std::vector<std::string>::iterator it = roots.begin();
+  while (it != roots.end())
+  {
+    it = it->empty() ? roots.erase(it) : it + 1;
+  }
+  return roots;
+}
+
+void ClassIndex::getCrawledDirectories(const std::string& dir, std::vector<std::string>& dirs)
+{
+  std::set<std::pair<dev_t, ino_t> > visited;
+  std::vector<std::string> pending(1, dir);
+  while (!pending.empty())
+  {
+    std::string path = pending.back();
+    pending.pop_back();
+
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) ||
+        !visited.insert(std::make_pair(st.st_dev, st.st_ino)).second)
+    {
+      continue;
+    }
+
+    // Like rospack, don't look inside packages or below directories that opt out of the crawl
+    const char* stops[] = { "/package.xml", "/manifest.xml" };
+    const char* ignores[] = { "/CATKIN_IGNORE", "/rospack_nosubdirs" };
+    bool package = false;
+    for (size_t i = 0; i < sizeof(stops) / sizeof(stops[0]) && !package; ++i)
+    {
+      package = access((path + stops[i]).c_str(), F_OK) == 0;
+    }
+    // Adding or removing a package or a marker file below here changes the directory's mtime.
+    // The package path roots themselves are always tracked.
+    if (package)
+    {
+      if (path == dir)
+      {
+        dirs.push_back(path);
+      }
+      continue;
+    }
+    dirs.push_back(path);
+    bool ignored = false;
+    for (size_t i = 0; i < sizeof(ignores) / sizeof(ignores[0]) && !ignored; ++i)
+    {
+      ignored = access((path + ignores[i]).c_str(), F_OK) == 0;
+    }
+    if (ignored)
+    {
+      continue;
+    }
+
+    DIR* d = opendir(path.c_str());
+    if (!d)
+    {
+      continue;
+    }
+    while (struct dirent* entry = readdir(d))
+    {
+      if (entry->d_name[0] != '.')
+      {
+        pending.push_back(path + "/" + entry->d_name);
+      }
+    }
+    closedir(d);
+  }
+}
+
+bool ClassIndex::load()
+{
+  plugin_xml_paths_.clear();
+  classes_.clear();
+
+  if (path_.empty())
+  {
+    return false;
+  }
+
+  std::ifstream in(path_.c_str());
+  if (!in)
+  {
+    return false;
+  }
+
+  const char* env = getenv("ROS_PACKAGE_PATH");
+  std::string package_path = env ? env : "";
+
+  bool header = false;
+  bool package_path_matches = false;
+  std::string line;
+  std::vector<std::string> fields;
+  try
+  {
+    while (std::getline(in, line))
+    {
+      if (line.empty())
+      {
+        continue;
+      }
+
+      boost::split(fields, line, boost::is_any_of("\t"));
+      const std::string& kind = fields[0];
+      if (!header)
+      {
+        header = (kind == INDEX_MAGIC && fields.size() == 2 &&
+                  boost::lexical_cast<int>(fields[1]) == INDEX_VERSION);
+        if (!header)
+        {
+          break;
+        }
+      }
+      else if (kind == "package_path" && fields.size() == 2)
+      {
+        package_path_matches = (fields[1] == package_path);
+        if (!package_path_matches)
+        {
+          ROS_DEBUG("Nodelet class index %s is out of date: ROS_PACKAGE_PATH changed", path_.c_str());
+          break;
+        }
+      }
+      else if (kind == "file" && fields.size() == 4)
+      {
+        File file;
+        if (!stat(fields[3], file) || file.mtime != boost::lexical_cast<int64_t>(fields[1]) ||
+            file.size != boost::lexical_cast<int64_t>(fields[2]))
+        {
+          ROS_DEBUG("Nodelet class index %s is out of date: %s changed", path_.c_str(), fields[3].c_str());
+          package_path_matches = false;
+          break;
+        }
+      }
+      else if (kind == "plugin" && fields.size() == 2)
+      {
+        plugin_xml_paths_.push_back(fields[1]);
+      }
+      else if (kind == "class" && fields.size() == 4)
+      {
+        Class c;
+        c.type = fields[1];
+        c.plugin_xml = fields[2];
+        c.library = fields[3];
+        classes_.push_back(c);
+      }
+      else
+      {
+        ROS_DEBUG("Ignoring malformed line in nodelet class index %s: %s", path_.c_str(), line.c_str());
+      }
+    }
+  }
+  catch (boost::bad_lexical_cast&)
+  {
+    header = false;
+  }
+
+  if (!header || !package_path_matches)
+  {
+    plugin_xml_paths_.clear();
+    classes_.clear();
+    return false;
+  }
+
+  return true;
+}
+
+void ClassIndex::save(const std::vector<std::string>& plugin_xml_paths, const std::vector<Class>& classes)
+{
+  plugin_xml_paths_ = plugin_xml_paths;
+  classes_ = classes;
+
+  if (path_.empty())
+  {
+    return;
+  }
+
+  // Directories whose contents decide which packages are found
+  std::vector<File> files;
+  std::vector<std::string> tracked;
+  std::vector<std::string> roots = getPackagePathRoots();
+  for (size_t i = 0; i < roots.size(); ++i)
+  {
+    getCrawledDirectories(roots[i], tracked);
+  }
+  for (size_t i = 0; i < plugin_xml_paths.size(); ++i)
+  {
+    tracked.push_back(plugin_xml_paths[i]);
+    std::string manifest = findManifest(plugin_xml_paths[i]);
+    if (!manifest.empty())
+    {
+      tracked.push_back(manifest);
+    }
+  }
+  for (size_t i = 0; i < tracked.size(); ++i)
+  {
+    File file;
+    if (stat(tracked[i], file))
+    {
+      files.push_back(file);
+    }
+  }
+
+  const char* env = getenv("ROS_PACKAGE_PATH");
+
+  std::ostringstream out;
+  out << INDEX_MAGIC << '\t' << INDEX_VERSION << '\n';
+  out << "package_path\t" << (env ? env : "") << '\n';
+  for (size_t i = 0; i < files.size(); ++i)
+  {
+    out << "file\t" << files[i].mtime << '\t' << files[i].size << '\t' << files[i].path << '\n';
+  }
+  for (size_t i = 0; i < plugin_xml_paths.size(); ++i)
+  {
+    out << "plugin\t" << plugin_xml_paths[i] << '\n';
+  }
+  for (size_t i = 0; i < classes.size(); ++i)
+  {
+    out << "class\t" << classes[i].type << '\t' << classes[i].plugin_xml << '\t' << classes[i].library << '\n';
+  }
+
+  // Write a private file and rename it over the index, so readers never see a partial index
+  std::ostringstream tmp_path;
+  tmp_path << path_ << ".tmp." << getpid();
+  {
+    std::ofstream file(tmp_path.str().c_str());
+    file << out.str();
+    if (!file.flush())
+    {
+      ROS_DEBUG("Unable to write nodelet class index %s", tmp_path.str().c_str());
+      file.close();
+      std::remove(tmp_path.str().c_str());
+      return;
+    }
+  }
+
+  if (std::rename(tmp_path.str().c_str(), path_.c_str()) != 0)
+  {
+    ROS_DEBUG("Unable to write nodelet class index %s", path_.c_str());
+    std::remove(tmp_path.str().c_str());
+  }
+}
+
+} // namespace detail
+} // namespace nodelet
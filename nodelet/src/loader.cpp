@@ -31,37 +31,55 @@
 #include <nodelet/nodelet.h>
 #include <nodelet/detail/callback_queue.h>
 #include <nodelet/detail/callback_queue_manager.h>
-#include <pluginlib/class_loader.h>
+#include <nodelet/detail/memory_accounting.h>
+#include <nodelet/detail/shared_class_loader.h>
 #include <bondcpp/bond.h>
 
 #include <ros/ros.h>
 #include <ros/callback_queue.h>
 #include <nodelet/NodeletLoad.h>
+#include <nodelet/NodeletLoadBatch.h>
 #include <nodelet/NodeletList.h>
+#include <nodelet/NodeletListInfo.h>
+#include <nodelet/NodeletReload.h>
 #include <nodelet/NodeletUnload.h>
 
+#include <boost/atomic.hpp>
 #include <boost/ptr_container/ptr_map.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/utility.hpp>
 
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <set>
+
 /*
 Between Loader, Nodelet, CallbackQueue and CallbackQueueManager, who owns what?
 
 Loader contains the CallbackQueueManager. Loader and CallbackQueueManager share
-ownership of the CallbackQueues. Loader is primary owner of the Nodelets, but
-each CallbackQueue has weak ownership of its associated Nodelet.
+ownership of the CallbackQueues. Loader is the sole owner of the Nodelets;
+CallbackQueues don't refer to their Nodelet at all.
 
-Loader ensures that the CallbackQueues associated with a Nodelet outlive that
-Nodelet. CallbackQueueManager ensures that CallbackQueues continue to survive as
-long as they have pending callbacks. 
+When Loader unloads a Nodelet, ManagedNodelet's destructor calls
+CallbackQueueManager::removeQueue() for the associated CallbackQueues before the
+Nodelet is destroyed. removeQueue() disables the queue, so it accepts no more
+callbacks and calls no more of the ones it holds, and then waits until no
+worker thread is inside the queue's callOne(). Only then is the Nodelet
+released, so no callback can run against a destroyed Nodelet, and a Nodelet
+that is continuously executing callbacks can't persist in a "zombie" state
+after being unloaded.
 
-CallbackQueue holds a weak_ptr to its associated Nodelet, which it attempts to
-lock before invoking any callback. So any lingering callbacks processed after a
-Nodelet is destroyed are safely discarded, and then the CallbackQueue expires.
+Loader::unloadDetached() takes the Nodelet out of the Loader just the same, but
+leaves the removeQueue() wait and the destruction to a reaper thread. The
+Nodelet may live on until its running callbacks have returned, and its name
+stays reserved until then, so a new Nodelet can't be loaded under it meanwhile.
 
-When Loader unloads a Nodelet, it calls CallbackQueueManager::removeQueue() for
-the associated CallbackQueues, which prevents them from adding any more callbacks
-to CallbackQueueManager. Otherwise a Nodelet that is continuously executing
-callbacks might persist in a "zombie" state after being unloaded.
+The one exception is a Nodelet that is unloaded from one of its own callbacks:
+that callback is still on the stack, and it must not touch the Nodelet after
+the unload returns.
  */
 
 namespace nodelet
@@ -69,85 +87,242 @@ namespace nodelet
 
 typedef boost::shared_ptr<Nodelet> NodeletPtr;
 
+static void reportUnload(const std::string& name, bool success)
+{
+  if (!success)
+  {
+    ROS_ERROR("Failed to find nodelet with name '%s' to unload.", name.c_str());
+  }
+}
+
 /// @todo Consider moving this to nodelet executable, it's implemented entirely on top of Loader
 class LoaderROS
 {
 public:
-  LoaderROS(Loader* parent, const ros::NodeHandle& nh)
+  LoaderROS(Loader* parent, const ros::NodeHandle& nh, uint32_t num_service_threads, uint32_t num_bond_threads)
   : parent_(parent)
   , nh_(nh)
-  , bond_spinner_(1, &bond_callback_queue_)
+  , service_spinner_(num_service_threads, &service_callback_queue_)
+  , bond_spinner_(num_bond_threads, &bond_callback_queue_)
   {
-    load_server_ = nh_.advertiseService("load_nodelet", &LoaderROS::serviceLoad, this);
-    unload_server_ = nh_.advertiseService("unload_nodelet", &LoaderROS::serviceUnload, this);
-    list_server_ = nh_.advertiseService("list", &LoaderROS::serviceList, this);
+    // Serve requests from our own threads, so that a slow load only ties up the thread waiting
+    // for it and not the caller's spinner, other requests or bonds.
+    nh_.param("unload_drain_timeout", unload_drain_timeout_, 1.0);
 
+    ros::NodeHandle service_nh(nh_);
+    service_nh.setCallbackQueue(&service_callback_queue_);
+    load_server_ = service_nh.advertiseService("load_nodelet", &LoaderROS::serviceLoad, this);
+    load_batch_server_ = service_nh.advertiseService("load_nodelet_batch", &LoaderROS::serviceLoadBatch, this);
+    unload_server_ = service_nh.advertiseService("unload_nodelet", &LoaderROS::serviceUnload, this);
+    unload_detached_server_ = service_nh.advertiseService("unload_nodelet_detached",
+                                                          &LoaderROS::serviceUnloadDetached, this);
+    reload_server_ = service_nh.advertiseService("reload_nodelet", &LoaderROS::serviceReload, this);
+    list_server_ = service_nh.advertiseService("list", &LoaderROS::serviceList, this);
+    list_info_server_ = service_nh.advertiseService("list_info", &LoaderROS::serviceListInfo, this);
+
+    service_spinner_.start();
     bond_spinner_.start();
   }
 
 private:
-  bool serviceLoad(nodelet::NodeletLoad::Request &req,
-                   nodelet::NodeletLoad::Response &res)
+  static M_string buildRemappings(const V_string& sources, const V_string& targets)
   {
-    boost::mutex::scoped_lock lock(lock_);
-
-    // build map
     M_string remappings;
-    if (req.remap_source_args.size() != req.remap_target_args.size())
+    if (sources.size() != targets.size())
     {
       ROS_ERROR("Bad remapppings provided, target and source of different length");
     }
     else
     {
-      for (size_t i = 0; i < req.remap_source_args.size(); ++i)
+      for (size_t i = 0; i < sources.size(); ++i)
       {
-        remappings[ros::names::resolve(req.remap_source_args[i])] = ros::names::resolve(req.remap_target_args[i]);
-        ROS_DEBUG("%s:%s\n", ros::names::resolve(req.remap_source_args[i]).c_str(), remappings[ros::names::resolve(req.remap_source_args[i])].c_str());
+        remappings[ros::names::resolve(sources[i])] = ros::names::resolve(targets[i]);
+        ROS_DEBUG("%s:%s\n", ros::names::resolve(sources[i]).c_str(), remappings[ros::names::resolve(sources[i])].c_str());
       }
     }
+    return remappings;
+  }
 
-    res.success = parent_->load(req.name, req.type, remappings, req.my_argv);
+  // Decodes the parameter blob of a load request, if there is one
+  static bool parseParams(const std::string& name, const std::string& xml,
+                          boost::shared_ptr<XmlRpc::XmlRpcValue>& params)
+  {
+    if (xml.empty())
+    {
+      return true;
+    }
+
+    int offset = 0;
+    params.reset(new XmlRpc::XmlRpcValue);
+    if (!params->fromXml(xml, &offset))
+    {
+      ROS_ERROR("Cannot load nodelet %s: bad parameters in the load request", name.c_str());
+      params.reset();
+      return false;
+    }
+    return true;
+  }
+
+  bool serviceLoad(nodelet::NodeletLoad::Request &req,
+                   nodelet::NodeletLoad::Response &res)
+  {
+    Loader::LoadRequest request;
+    request.name = req.name;
+    request.type = req.type;
+    request.remappings = buildRemappings(req.remap_source_args, req.remap_target_args);
+    request.my_argv = req.my_argv;
+
+    res.success = parent_->load(request);
 
     // If requested, create bond to sister process
     if (res.success && !req.bond_id.empty())
     {
-      bond::Bond* bond = new bond::Bond(nh_.getNamespace() + "/bond", req.bond_id);
-      bond_map_.insert(req.name, bond);
-      bond->setCallbackQueue(&bond_callback_queue_);
-      bond->setBrokenCallback(boost::bind(&LoaderROS::unload, this, req.name));
-      bond->start();
+      addBond(req.name, req.bond_id);
     }
     return res.success;
   }
 
+  bool serviceLoadBatch(nodelet::NodeletLoadBatch::Request &req,
+                        nodelet::NodeletLoadBatch::Response &res)
+  {
+    // Entries with bad parameters are left out, which also fails the entries depending on them
+    std::vector<Loader::LoadRequest> requests;
+    std::vector<size_t> indices;
+    for (size_t i = 0; i < req.nodelets.size(); ++i)
+    {
+      const nodelet::NodeletLoadEntry& entry = req.nodelets[i];
+      Loader::LoadRequest request;
+      request.name = entry.name;
+      request.type = entry.type;
+      request.remappings = buildRemappings(entry.remap_source_args, entry.remap_target_args);
+      request.my_argv = entry.my_argv;
+      request.depends = entry.depends;
+      if (parseParams(entry.name, entry.params, request.params))
+      {
+        requests.push_back(request);
+        indices.push_back(i);
+      }
+    }
+
+    std::vector<bool> success = parent_->loadMany(requests);
+
+    res.success.assign(req.nodelets.size(), false);
+    for (size_t i = 0; i < success.size(); ++i)
+    {
+      res.success[indices[i]] = success[i];
+      if (success[i] && !req.nodelets[indices[i]].bond_id.empty())
+      {
+        addBond(req.nodelets[indices[i]].name, req.nodelets[indices[i]].bond_id);
+      }
+    }
+
+    // Failures are reported per entry
+    return true;
+  }
+
+  // Nodelets loaded with the same bond id share one bond, so a client loading many nodelets only
+  // keeps up one heartbeat.  The bond lasts until its last nodelet is unloaded.
+  void addBond(const std::string& name, const std::string& bond_id)
+  {
+    boost::mutex::scoped_lock lock(lock_);
+    M_stringToBondGroup::iterator it = bond_groups_.find(bond_id);
+    if (it == bond_groups_.end())
+    {
+      BondGroup* group = new BondGroup;
+      group->bond.reset(new bond::Bond(nh_.getNamespace() + "/bond", bond_id));
+      it = bond_groups_.insert(const_cast<std::string&>(bond_id), group).first;
+      group->bond->setCallbackQueue(&bond_callback_queue_);
+      group->bond->setBrokenCallback(boost::bind(&LoaderROS::bondBroken, this, bond_id));
+      group->bond->start();
+    }
+    it->second->names.insert(name);
+    bond_ids_[name] = bond_id;
+  }
+
   bool serviceUnload(nodelet::NodeletUnload::Request &req,
                      nodelet::NodeletUnload::Response &res)
   {
-    res.success = unload(req.name);
+    res.success = parent_->unload(req.name);
+    if (!res.success)
+    {
+      reportUnload(req.name, res.success);
+      return res.success;
+    }
+
+    // Break the bond before replying; the client breaks its end once it has the reply
+    breakBond(req.name);
     return res.success;
   }
 
-  bool unload(const std::string& name)
+  bool serviceUnloadDetached(nodelet::NodeletUnload::Request &req,
+                             nodelet::NodeletUnload::Response &res)
   {
-    boost::mutex::scoped_lock lock(lock_);
+    // The nodelet is destroyed in the background, so a slow destructor doesn't hold up the reply.
+    // Its name stays taken until then.
+    res.success = parent_->unloadDetached(req.name, unload_drain_timeout_);
+    if (!res.success)
+    {
+      reportUnload(req.name, res.success);
+      return res.success;
+    }
 
-    bool success = parent_->unload(name);
-    if (!success)
+    // Break the bond before replying; the client breaks its end once it has the reply
+    breakBond(req.name);
+    return res.success;
+  }
+
+  bool serviceReload(nodelet::NodeletReload::Request &req,
+                     nodelet::NodeletReload::Response &res)
+  {
+    // The nodelet keeps its name, so its bond carries over
+    res.success = parent_->reload(req.name, req.type);
+    return res.success;
+  }
+
+  void bondBroken(const std::string& bond_id)
+  {
+    M_stringToBondGroup::auto_type group;
     {
-      ROS_ERROR("Failed to find nodelet with name '%s' to unload.", name.c_str());
-      return success;
+      boost::mutex::scoped_lock lock(lock_);
+      M_stringToBondGroup::iterator it = bond_groups_.find(bond_id);
+      if (it == bond_groups_.end())
+      {
+        return;
+      }
+      group = bond_groups_.release(it);
+      for (std::set<std::string>::iterator name = group->names.begin(); name != group->names.end(); ++name)
+      {
+        bond_ids_.erase(*name);
+      }
+    }
+
+    // Don't make other bonds wait for the unloads
+    for (std::set<std::string>::iterator name = group->names.begin(); name != group->names.end(); ++name)
+    {
+      parent_->unloadAsync(*name, boost::bind(reportUnload, *name, _1));
     }
+    group->bond->setBrokenCallback(boost::function<void(void)>());
+  }
 
-    // break the bond, if there is one
-    M_stringToBond::iterator it = bond_map_.find(name);
-    if (it != bond_map_.end()) {
-        // disable callback for broken bond, as we are breaking it intentially now
-        it->second->setBrokenCallback(boost::function<void(void)>());
-        // erase (and break) bond
-        bond_map_.erase(name);
+  void breakBond(const std::string& name)
+  {
+    boost::mutex::scoped_lock lock(lock_);
+    M_string::iterator id = bond_ids_.find(name);
+    if (id == bond_ids_.end())
+    {
+      return;
     }
 
-    return success;
+    M_stringToBondGroup::iterator it = bond_groups_.find(id->second);
+    bond_ids_.erase(id);
+    it->second->names.erase(name);
+    if (it->second->names.empty())
+    {
+      // disable callback for broken bond, as we are breaking it intentially now
+      it->second->bond->setBrokenCallback(boost::function<void(void)>());
+      // erase (and break) bond
+      bond_groups_.erase(it);
+    }
   }
 
   bool serviceList(nodelet::NodeletList::Request &,
@@ -157,18 +332,60 @@ private:
     return true;
   }
 
+  bool serviceListInfo(nodelet::NodeletListInfo::Request &,
+                       nodelet::NodeletListInfo::Response &res)
+  {
+    std::vector<Loader::NodeletInfo> infos = parent_->listNodeletInfo();
+    res.nodelets.resize(infos.size());
+    for (size_t i = 0; i < infos.size(); ++i)
+    {
+      nodelet::NodeletInfo& out = res.nodelets[i];
+      out.name = infos[i].name;
+      out.type = infos[i].type;
+      out.pool = infos[i].pool;
+      out.worker = infos[i].worker;
+      out.load_stamp.fromSec(infos[i].load_stamp);
+      out.init_duration = infos[i].init_duration;
+      out.queue_depth = infos[i].queue_depth;
+      out.callbacks_executed = infos[i].callbacks_executed;
+      out.cpu_time = infos[i].cpu_time;
+      out.queue_latency_mean = infos[i].queue_latency_mean;
+      out.queue_latency_max = infos[i].queue_latency_max;
+      out.message_pool_hits = infos[i].message_pool_hits;
+      out.message_pool_misses = infos[i].message_pool_misses;
+      out.memory_live_bytes = infos[i].memory_live_bytes;
+      out.memory_allocations = infos[i].memory_allocations;
+      out.memory_allocated_bytes = infos[i].memory_allocated_bytes;
+    }
+    return true;
+  }
+
   Loader* parent_;
   ros::NodeHandle nh_;
+  double unload_drain_timeout_; ///<! Seconds a detached unload request waits for running callbacks
+  ros::CallbackQueue service_callback_queue_;
+  ros::AsyncSpinner service_spinner_;
   ros::ServiceServer load_server_;
+  ros::ServiceServer load_batch_server_;
   ros::ServiceServer unload_server_;
+  ros::ServiceServer unload_detached_server_;
+  ros::ServiceServer reload_server_;
   ros::ServiceServer list_server_;
+  ros::ServiceServer list_info_server_;
 
-  boost::mutex lock_;
+  boost::mutex lock_; ///<! Guards bond_groups_ and bond_ids_
 
   ros::CallbackQueue bond_callback_queue_;
   ros::AsyncSpinner bond_spinner_;
-  typedef boost::ptr_map<std::string, bond::Bond> M_stringToBond;
-  M_stringToBond bond_map_;
+
+  struct BondGroup
+  {
+    boost::scoped_ptr<bond::Bond> bond;
+    std::set<std::string> names; ///<! Nodelets unloaded when the bond breaks
+  };
+  typedef boost::ptr_map<std::string, BondGroup> M_stringToBondGroup;
+  M_stringToBondGroup bond_groups_; ///<! By bond id
+  M_string bond_ids_;               ///<! Bond id by nodelet name
 };
 
 // Owns a Nodelet and its callback queues
@@ -178,61 +395,553 @@ struct ManagedNodelet : boost::noncopyable
   detail::CallbackQueuePtr mt_queue;
   NodeletPtr nodelet; // destroyed before the queues
   detail::CallbackQueueManager* callback_manager;
+  detail::MemoryAccount* memory_account; // NULL unless memory accounting is on, released with this
+  bool drained;
+
+  std::string type;
+  std::string pool;
+  M_string remappings;
+  V_string my_argv;
+  ros::WallTime load_stamp;
+  ros::WallDuration init_duration;
 
   /// @todo Maybe addQueue/removeQueue should be done by CallbackQueue
-  ManagedNodelet(const NodeletPtr& nodelet, detail::CallbackQueueManager* cqm)
-    : st_queue(new detail::CallbackQueue(cqm, nodelet))
-    , mt_queue(new detail::CallbackQueue(cqm, nodelet))
+  ManagedNodelet(const NodeletPtr& nodelet, detail::CallbackQueueManager* cqm,
+                 detail::MemoryAccount* account = NULL, bool paused = false)
+    : st_queue(new detail::CallbackQueue(cqm))
+    , mt_queue(new detail::CallbackQueue(cqm))
     , nodelet(nodelet)
     , callback_manager(cqm)
+    , memory_account(account)
+    , drained(false)
   {
+    st_queue->setMemoryAccount(account);
+    mt_queue->setMemoryAccount(account);
+
     // NOTE: Can't do this in CallbackQueue constructor because the shared_ptr to
     // it doesn't exist then.
-    callback_manager->addQueue(st_queue, false);
-    callback_manager->addQueue(mt_queue, true);
+    callback_manager->addQueue(st_queue, false, paused);
+    callback_manager->addQueue(mt_queue, true, paused);
   }
 
-  ~ManagedNodelet()
+  /// Stop calling the nodelet's callbacks, and wait for the ones running to return
+  void drain()
   {
+    if (drained)
+    {
+      return;
+    }
     callback_manager->removeQueue(st_queue);
     callback_manager->removeQueue(mt_queue);
+    drained = true;
+  }
+
+  void getInfo(Loader::NodeletInfo& info)
+  {
+    info.type = type;
+    info.pool = pool;
+    info.load_stamp = load_stamp.toSec();
+    info.init_duration = init_duration.toSec();
+    info.queue_depth = st_queue->size() + mt_queue->size();
+    getLatency(info.callbacks_executed, info.queue_latency_mean, info.queue_latency_max);
+    info.cpu_time = (st_queue->getCPUTime() + mt_queue->getCPUTime()).toSec();
+    info.worker = callback_manager->getQueueThread(st_queue);
+
+    info.message_pool_hits = 0;
+    info.message_pool_misses = 0;
+    std::vector<MessagePoolStats> pools = nodelet->getMessagePoolStats();
+    for (size_t i = 0; i < pools.size(); ++i)
+    {
+      info.message_pool_hits += pools[i].hits;
+      info.message_pool_misses += pools[i].misses;
+    }
+
+    info.memory_live_bytes = memory_account ? memory_account->live_bytes.load() : 0;
+    info.memory_allocations = memory_account ? memory_account->allocations.load() : 0;
+    info.memory_allocated_bytes = memory_account ? memory_account->allocated_bytes.load() : 0;
+  }
+
+  void getLatency(uint64_t& count, double& mean, double& max)
+  {
+    detail::CallbackQueue::LatencyStats st = st_queue->getLatencyStats();
+    detail::CallbackQueue::LatencyStats mt = mt_queue->getLatencyStats();
+    count = st.count + mt.count;
+    mean = count > 0 ? (st.total + mt.total).toSec() / count : 0.0;
+    max = std::max(st.max, mt.max).toSec();
+  }
+
+  ~ManagedNodelet()
+  {
+    drain();
+    // Nothing is charged to the account once the queues are drained.  Memory the nodelet still
+    // holds keeps it until freed.
+    detail::releaseMemoryAccount(memory_account);
+  }
+};
+
+static bool parseOverflowPolicy(const std::string& name, detail::CallbackQueue::OverflowPolicy& policy)
+{
+  if (name == "drop_oldest")
+    policy = detail::CallbackQueue::DropOldest;
+  else if (name == "drop_newest")
+    policy = detail::CallbackQueue::DropNewest;
+  else if (name == "block")
+    policy = detail::CallbackQueue::Block;
+  else if (name == "coalesce")
+    policy = detail::CallbackQueue::Coalesce;
+  else
+    return false;
+  return true;
+}
+
+static void runAsync(const boost::shared_ptr<boost::promise<bool> >& promise,
+                     const boost::function<bool ()>& request, const Loader::CompletionCallback& done)
+{
+  bool result = false;
+  try
+  {
+    result = request();
+  }
+  catch (std::exception& e)
+  {
+    ROS_ERROR("Asynchronous nodelet request failed: %s", e.what());
+  }
+
+  if (done)
+  {
+    done(result);
+  }
+  promise->set_value(result);
+}
+
+/// Runs posted requests on threads of its own.  A thread is started whenever there are more
+/// requests than idle threads, up to max_threads; beyond that requests wait.
+class ThreadPool : boost::noncopyable
+{
+public:
+  explicit ThreadPool(size_t max_threads)
+  : idle_(0)
+  , num_threads_(0)
+  , max_threads_(max_threads)
+  , stopping_(false)
+  {}
+
+  void setMaxThreads(size_t max_threads)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    max_threads_ = max_threads;
+  }
+
+  /// \return false if the pool is stopping, and the request won't run
+  bool post(const boost::function<void ()>& request)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (stopping_)
+    {
+      return false;
+    }
+
+    requests_.push_back(request);
+    if (requests_.size() > idle_ && num_threads_ < max_threads_)
+    {
+      threads_.create_thread(boost::bind(&ThreadPool::run, this));
+      ++num_threads_;
+    }
+    else
+    {
+      cond_.notify_one();
+    }
+    return true;
+  }
+
+  /// Finishes the outstanding requests and refuses new ones
+  void stop()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stopping_ = true;
+    }
+    cond_.notify_all();
+    threads_.join_all();
+  }
+
+private:
+  void run()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    for (;;)
+    {
+      while (requests_.empty() && !stopping_)
+      {
+        ++idle_;
+        cond_.wait(lock);
+        --idle_;
+      }
+
+      if (requests_.empty())
+      {
+        return;
+      }
+
+      boost::function<void ()> request = requests_.front();
+      requests_.pop_front();
+
+      lock.unlock();
+      request();
+      lock.lock();
+    }
   }
+
+  std::deque<boost::function<void ()> > requests_;
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  boost::thread_group threads_;
+  size_t idle_;
+  size_t num_threads_;
+  size_t max_threads_;
+  bool stopping_;
 };
 
 struct Loader::Impl
 {
+  static const size_t DEFAULT_ASYNC_THREADS = 4;
+
   boost::shared_ptr<LoaderROS> services_;
 
+  typedef detail::SharedClassLoader::ClassLoader ClassLoader;
+
   boost::function<boost::shared_ptr<Nodelet> (const std::string& lookup_name)> create_instance_;
   boost::function<void ()> refresh_classes_;
+  boost::shared_ptr<detail::SharedClassLoader> shared_class_loader_; ///<! Unless create_instance_ was user-provided
+  boost::shared_ptr<ClassLoader> class_loader_;
   boost::shared_ptr<detail::CallbackQueueManager> callback_manager_; // Must outlive nodelets_
+  std::map<std::string, boost::shared_ptr<detail::CallbackQueueManager> > pools_; // Likewise
+
+  boost::mutex factory_mutex_; ///<! Serializes a user-provided create_instance_
+  boost::mutex* class_loader_mutex_; ///<! Serializes create_instance_ and refresh_classes_
+
+  /// Loader's public methods must lock this to preserve internal integrity.  Methods that only
+  /// read the loaded nodelets take it shared, so they don't wait for each other.
+  boost::shared_mutex lock_;
 
   typedef boost::ptr_map<std::string, ManagedNodelet> M_stringToNodelet;
   M_stringToNodelet nodelets_; ///<! A map of name to currently constructed nodelets
+  std::set<std::string> loading_; ///<! Names reserved by loads in progress
+
+  uint32_t max_queue_size_; ///<! Limit on pending callbacks per nodelet queue, 0 for unbounded
+  detail::CallbackQueue::OverflowPolicy overflow_policy_;
+
+  ThreadPool async_pool_; ///<! Runs loadAsync() and unloadAsync() requests, and preloading
+  // Reaps detached unloads.  It isn't bounded, so that a nodelet whose callbacks never return
+  // holds up nothing but its own reap; normally one thread is all it takes.
+  ThreadPool reap_pool_;
 
   Impl()
+    : class_loader_mutex_(0)
+    , max_queue_size_(0)
+    , overflow_policy_(detail::CallbackQueue::DropOldest)
+    , async_pool_(DEFAULT_ASYNC_THREADS)
+    , reap_pool_(std::numeric_limits<size_t>::max())
   {
     // Under normal circumstances, we use pluginlib to load any registered nodelet
-    typedef pluginlib::ClassLoader<Nodelet> Loader;
-    boost::shared_ptr<Loader> loader(new Loader("nodelet", "nodelet::Nodelet"));
+    shared_class_loader_ = detail::SharedClassLoader::get();
+    class_loader_ = shared_class_loader_->loader;
+    class_loader_mutex_ = &shared_class_loader_->mutex;
+
     // create_instance_ is self-contained; it owns a copy of the loader shared_ptr
-    create_instance_ = boost::bind(&Loader::createInstance, loader, _1);
-    refresh_classes_ = boost::bind(&Loader::refreshDeclaredClasses, loader);
+    create_instance_ = boost::bind(&ClassLoader::createInstance, class_loader_, _1);
+    refresh_classes_ = boost::bind(&detail::SharedClassLoader::refresh, shared_class_loader_);
   }
 
   Impl(const boost::function<boost::shared_ptr<Nodelet> (const std::string& lookup_name)>& create_instance)
     : create_instance_(create_instance)
+    , class_loader_mutex_(&factory_mutex_)
+    , max_queue_size_(0)
+    , overflow_policy_(detail::CallbackQueue::DropOldest)
+    , async_pool_(DEFAULT_ASYNC_THREADS)
+    , reap_pool_(std::numeric_limits<size_t>::max())
+  {
+  }
+
+  NodeletPtr createInstance(const std::string& name, const std::string& type,
+                            detail::MemoryAccount* account = NULL)
   {
+    // pluginlib's ClassLoader isn't thread-safe
+    boost::mutex::scoped_lock lock(*class_loader_mutex_);
+    try
+    {
+      return construct(type, account);
+    }
+    catch (std::runtime_error& e)
+    {
+      // If we cannot refresh the nodelet cache, fail immediately
+      if(!refresh_classes_)
+      {
+        ROS_ERROR("Failed to load nodelet [%s] of type [%s]: %s", name.c_str(), type.c_str(), e.what());
+        return NodeletPtr();
+      }
+
+      // otherwise, refresh the cache and try again.
+      try
+      {
+        refresh_classes_();
+        return construct(type, account);
+      }
+      catch (std::runtime_error& e2)
+      {
+        // dlopen() can return inconsistent results currently (see
+        // https://sourceware.org/bugzilla/show_bug.cgi?id=17833), so make sure
+        // that we display the messages of both exceptions to the user.
+        ROS_ERROR("Failed to load nodelet [%s] of type [%s] even after refreshing the cache: %s", name.c_str(), type.c_str(), e2.what());
+        ROS_ERROR("The error before refreshing the cache was: %s", e.what());
+        return NodeletPtr();
+      }
+    }
+  }
+
+  /// Charges only the nodelet's constructor to account, not loading its library
+  NodeletPtr construct(const std::string& type, detail::MemoryAccount* account)
+  {
+    if (account && class_loader_)
+    {
+      class_loader_->loadLibraryForClass(type);
+    }
+
+    detail::MemoryAccountScope account_scope(account);
+    return create_instance_(type);
   }
 
-  void advertiseRosApi(Loader* parent, const ros::NodeHandle& server_nh)
+  void advertiseRosApi(Loader* parent, const ros::NodeHandle& server_nh, uint32_t num_worker_threads = 0)
   {
     int num_threads_param;
-    server_nh.param("num_worker_threads", num_threads_param, 0);
+    server_nh.param("num_worker_threads", num_threads_param, (int)num_worker_threads);
     callback_manager_.reset(new detail::CallbackQueueManager(num_threads_param));
     ROS_INFO("Initializing nodelet with %d worker threads.", (int)callback_manager_->getNumWorkerThreads());
-  
-    services_.reset(new LoaderROS(parent, server_nh));
+
+    int max_queue_size_param;
+    std::string policy_param;
+    server_nh.param("max_queue_size", max_queue_size_param, 0);
+    server_nh.param("queue_overflow_policy", policy_param, std::string("drop_oldest"));
+    max_queue_size_ = max_queue_size_param > 0 ? max_queue_size_param : 0;
+    if (!parseOverflowPolicy(policy_param, overflow_policy_))
+    {
+      ROS_WARN("Unknown queue_overflow_policy '%s', using drop_oldest. Valid policies are "
+               "drop_oldest, drop_newest, block and coalesce.", policy_param.c_str());
+      overflow_policy_ = detail::CallbackQueue::DropOldest;
+    }
+    if (max_queue_size_ > 0)
+    {
+      ROS_INFO("Limiting nodelet callback queues to %u callbacks (%s).", max_queue_size_, policy_param.c_str());
+    }
+
+    int num_service_threads_param;
+    server_nh.param("num_service_threads", num_service_threads_param, 4);
+    int num_bond_threads_param;
+    server_nh.param("num_bond_threads", num_bond_threads_param, 0); // 0 for one per CPU core
+    services_.reset(new LoaderROS(parent, server_nh, std::max(num_service_threads_param, 1),
+                                  std::max(num_bond_threads_param, 0)));
+
+    int num_async_threads_param;
+    server_nh.param("num_async_threads", num_async_threads_param, (int)DEFAULT_ASYNC_THREADS);
+    async_pool_.setMaxThreads(std::max(num_async_threads_param, 1));
+
+    std::vector<std::string> preload_param;
+    bool warmup_param;
+    server_nh.getParam("preload", preload_param);
+    server_nh.param("preload_warmup", warmup_param, false);
+    if (!preload_param.empty() && class_loader_)
+    {
+      async_pool_.post(boost::bind(&Impl::preload, this, preload_param, warmup_param));
+    }
+  }
+
+  /// Map each library path, file name and file name without extension to a type from that library
+  std::map<std::string, std::string> getPreloadLibraries()
+  {
+    std::map<std::string, std::string> libraries;
+    std::vector<std::string> types = class_loader_->getDeclaredClasses();
+    for (size_t i = 0; i < types.size(); ++i)
+    {
+      std::string path = class_loader_->getClassLibraryPath(types[i]);
+      std::string file = path.substr(path.rfind('/') + 1);
+      libraries.insert(std::make_pair(path, types[i]));
+      libraries.insert(std::make_pair(file, types[i]));
+      libraries.insert(std::make_pair(file.substr(0, file.find('.')), types[i]));
+    }
+    return libraries;
+  }
+
+  // Name of a declared nodelet type if entry is one, or else of a type from the library entry
+  // names in libraries.  Empty if there's no match.
+  std::string findPreloadType(const std::string& entry, const std::map<std::string, std::string>& libraries)
+  {
+    if (class_loader_->isClassAvailable(entry))
+    {
+      return entry;
+    }
+
+    std::map<std::string, std::string>::const_iterator it = libraries.find(entry);
+    return it != libraries.end() ? it->second : std::string();
+  }
+
+  /// Load the libraries of the given types or libraries, and construct one instance of each type if warmup is set
+  void preload(const std::vector<std::string>& entries, bool warmup)
+  {
+    ros::WallTime start = ros::WallTime::now();
+    std::map<std::string, std::string> library_types;
+    {
+      boost::mutex::scoped_lock lock(*class_loader_mutex_);
+      library_types = getPreloadLibraries();
+    }
+
+    std::set<std::string> libraries;
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+      NodeletPtr instance;
+      std::string library;
+      ros::WallTime library_start = ros::WallTime::now();
+      try
+      {
+        // Only hold off loads for one library at a time
+        boost::mutex::scoped_lock lock(*class_loader_mutex_);
+        std::string type = findPreloadType(entries[i], library_types);
+        if (type.empty())
+        {
+          ROS_WARN("Cannot preload %s: it is neither a declared nodelet type nor the library of one.",
+                   entries[i].c_str());
+          continue;
+        }
+
+        library = class_loader_->getClassLibraryPath(type);
+        if (!libraries.insert(library).second && !warmup)
+        {
+          continue;
+        }
+
+        class_loader_->loadLibraryForClass(type);
+        if (warmup)
+        {
+          instance = class_loader_->createInstance(type);
+        }
+      }
+      catch (std::runtime_error& e)
+      {
+        ROS_WARN("Failed to preload %s: %s", entries[i].c_str(), e.what());
+        continue;
+      }
+      instance.reset();
+
+      ROS_INFO("Preloaded %s (%s) in %.3f seconds.", entries[i].c_str(), library.c_str(),
+               (ros::WallTime::now() - library_start).toSec());
+    }
+
+    ROS_INFO("Preloaded %u nodelet libraries in %.3f seconds.", (uint32_t)libraries.size(),
+             (ros::WallTime::now() - start).toSec());
+  }
+
+  boost::shared_future<bool> postAsync(const boost::function<bool ()>& request,
+                                       const Loader::CompletionCallback& done)
+  {
+    boost::shared_ptr<boost::promise<bool> > promise(new boost::promise<bool>);
+    boost::shared_future<bool> future(promise->get_future());
+    if (!async_pool_.post(boost::bind(runAsync, promise, request, done)))
+    {
+      ROS_ERROR("Nodelet loader is shutting down, ignoring request.");
+      if (done)
+      {
+        done(false);
+      }
+      promise->set_value(false);
+    }
+    return future;
+  }
+
+  /// Create and initialize the nodelet described by request, or return NULL if that fails.  A paused
+  /// nodelet's callbacks wait in its queues until they are resumed with the CallbackQueueManager.
+  ManagedNodelet* instantiate(const Loader::LoadRequest& request, detail::CallbackQueueManager* cqm,
+                              bool paused = false)
+  {
+    const std::string& name = request.name;
+    // Charge what the nodelet allocates in its constructor and onInit() to it
+    detail::MemoryAccount* account = detail::createMemoryAccount();
+    NodeletPtr p = createInstance(name, request.type, account);
+    if (!p)
+    {
+      detail::releaseMemoryAccount(account);
+      return NULL;
+    }
+    ROS_DEBUG("Done loading nodelet %s", name.c_str());
+
+    ManagedNodelet* mn = new ManagedNodelet(p, cqm, account, paused);
+    mn->type = request.type;
+    mn->pool = request.pool;
+    mn->remappings = request.remappings;
+    mn->my_argv = request.my_argv;
+    if (max_queue_size_ > 0)
+    {
+      mn->st_queue->setMaxSize(max_queue_size_, overflow_policy_);
+      mn->mt_queue->setMaxSize(max_queue_size_, overflow_policy_);
+    }
+    try {
+      if (request.params)
+      {
+        ros::param::set(name, *request.params);
+      }
+      ros::WallTime init_start = ros::WallTime::now();
+      {
+        detail::MemoryAccountScope account_scope(account);
+        p->init(name, request.remappings, request.my_argv, mn->st_queue.get(), mn->mt_queue.get(),
+                request.params.get());
+      }
+      mn->load_stamp = ros::WallTime::now();
+      mn->init_duration = mn->load_stamp - init_start;
+      /// @todo Can we delay processing the queues until Nodelet::onInit() returns?
+
+      ROS_DEBUG("Done initing nodelet %s", name.c_str());
+    } catch(...) {
+      ROS_DEBUG ("Failed to initialize nodelet %s", name.c_str ());
+      delete mn;
+      mn = NULL;
+      p.reset();
+    }
+    return mn;
+  }
+
+  /// Drain and destroy a nodelet taken out by unloadDetached(), signalling drained once it is drained,
+  /// then give up its name
+  static void reap(Loader* parent, const boost::shared_ptr<ManagedNodelet>& mn, const std::string& name,
+                   double drain_timeout, const boost::shared_ptr<boost::promise<void> >& drained)
+  {
+    ros::WallTime start = ros::WallTime::now();
+    mn->drain();
+    ros::WallTime drain_end = ros::WallTime::now();
+    drained->set_value();
+
+    uint64_t count;
+    double mean, max;
+    mn->getLatency(count, mean, max);
+    mn->nodelet.reset();
+    double drain_time = (drain_end - start).toSec();
+    double destroy_time = (ros::WallTime::now() - drain_end).toSec();
+    {
+      boost::unique_lock<boost::shared_mutex> lock(parent->impl_->lock_);
+      parent->impl_->loading_.erase(name);
+    }
+
+    if (drain_time > drain_timeout)
+    {
+      ROS_WARN("Callbacks of nodelet %s took %.3f seconds to return after it was unloaded, more than the %.3f allowed.",
+               name.c_str(), drain_time, drain_timeout);
+    }
+    ROS_DEBUG("Done unloading nodelet %s (drained in %.6fs, destroyed in %.6fs, %llu callbacks, queue latency mean "
+              "%.6fs, max %.6fs)", name.c_str(), drain_time, destroy_time, (unsigned long long)count, mean, max);
+  }
+
+  /// Finishes the outstanding asynchronous requests and reaps, and refuses new ones
+  void stopAsync()
+  {
+    async_pool_.stop();
+    reap_pool_.stop();
   }
 };
 
@@ -246,6 +955,15 @@ Loader::Loader(bool provide_ros_api)
     impl_->callback_manager_.reset(new detail::CallbackQueueManager);
 }
 
+Loader::Loader(bool provide_ros_api, uint32_t num_worker_threads)
+  : impl_(new Impl)
+{
+  if (provide_ros_api)
+    impl_->advertiseRosApi(this, ros::NodeHandle("~"), num_worker_threads);
+  else
+    impl_->callback_manager_.reset(new detail::CallbackQueueManager(num_worker_threads));
+}
+
 Loader::Loader(const ros::NodeHandle& server_nh)
   : impl_(new Impl)
 {
@@ -260,98 +978,566 @@ Loader::Loader(const boost::function<boost::shared_ptr<Nodelet> (const std::stri
 
 Loader::~Loader()
 {
+  // Stop taking requests over ROS, then finish the asynchronous requests already made while
+  // everything they use is still around
+  impl_->services_.reset();
+  impl_->stopAsync();
 }
 
 bool Loader::load(const std::string &name, const std::string& type, const ros::M_string& remappings,
                   const std::vector<std::string> & my_argv)
 {
-  boost::mutex::scoped_lock lock(lock_);
-  if (impl_->nodelets_.count(name) > 0)
+  LoadRequest request;
+  request.name = name;
+  request.type = type;
+  request.remappings = remappings;
+  request.my_argv = my_argv;
+  return load(request);
+}
+
+bool Loader::load(const LoadRequest& request)
+{
+  const std::string& name = request.name;
+  detail::CallbackQueueManager* cqm = impl_->callback_manager_.get();
+
+  // Reserve the name, then instantiate and initialize the nodelet without holding lock_ so that
+  // other nodelets can load at the same time.
+  {
+    boost::unique_lock<boost::shared_mutex> lock(impl_->lock_);
+    if (impl_->nodelets_.count(name) > 0 || impl_->loading_.count(name) > 0)
+    {
+      ROS_ERROR("Cannot load nodelet %s for one exists with that name already, or is still being unloaded",
+                name.c_str());
+      return false;
+    }
+    if (!request.pool.empty())
+    {
+      std::map<std::string, boost::shared_ptr<detail::CallbackQueueManager> >::iterator it =
+        impl_->pools_.find(request.pool);
+      if (it == impl_->pools_.end())
+      {
+        ROS_ERROR("Cannot load nodelet %s into worker pool %s, which doesn't exist", name.c_str(),
+                  request.pool.c_str());
+        return false;
+      }
+      cqm = it->second.get();
+    }
+    impl_->loading_.insert(name);
+  }
+
+  ManagedNodelet* mn = impl_->instantiate(request, cqm);
+
+  boost::unique_lock<boost::shared_mutex> lock(impl_->lock_);
+  impl_->loading_.erase(name);
+  if (!mn)
   {
-    ROS_ERROR("Cannot load nodelet %s for one exists with that name already", name.c_str());
     return false;
   }
+  impl_->nodelets_.insert(const_cast<std::string&>(name), mn); // mn now owned by boost::ptr_map
+  return true;
+}
 
-  NodeletPtr p;
-  try
+boost::shared_future<bool> Loader::loadAsync(const std::string& name, const std::string& type,
+                                             const M_string& remappings, const V_string& my_argv,
+                                             const CompletionCallback& done)
+{
+  boost::function<bool ()> request = boost::bind(&Loader::load, this, name, type, remappings, my_argv);
+  return impl_->postAsync(request, done);
+}
+
+boost::shared_future<bool> Loader::loadAsync(const LoadRequest& request, const CompletionCallback& done)
+{
+  bool (Loader::*load_request)(const LoadRequest&) = &Loader::load;
+  return impl_->postAsync(boost::bind(load_request, this, request), done);
+}
+
+boost::shared_future<bool> Loader::unloadAsync(const std::string& name, const CompletionCallback& done)
+{
+  boost::function<bool ()> request = boost::bind(&Loader::unload, this, name);
+  return impl_->postAsync(request, done);
+}
+
+// Hands out the entries of a loadMany() call to its threads, each once its dependencies are loaded
+class LoadManyScheduler
+{
+public:
+  LoadManyScheduler(Loader* loader, const std::vector<Loader::LoadRequest>& requests)
+  : loader_(loader)
+  , requests_(requests)
+  , states_(requests.size(), Waiting)
+  , running_(0)
+  {
+    V_string loaded = loader->listLoadedNodelets();
+    loaded_.insert(loaded.begin(), loaded.end());
+    for (size_t i = 0; i < requests_.size(); ++i)
+    {
+      indices_.insert(std::make_pair(requests_[i].name, i));
+    }
+  }
+
+  void run()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    size_t i;
+    while (next(lock, i))
+    {
+      ++running_;
+      lock.unlock();
+      const Loader::LoadRequest& request = requests_[i];
+      bool success = loader_->load(request);
+      lock.lock();
+      --running_;
+      states_[i] = success ? Loaded : Failed;
+      cond_.notify_all();
+    }
+    cond_.notify_all();
+  }
+
+  std::vector<bool> results() const
+  {
+    std::vector<bool> results(states_.size());
+    for (size_t i = 0; i < states_.size(); ++i)
+    {
+      results[i] = (states_[i] == Loaded);
+    }
+    return results;
+  }
+
+private:
+  enum State { Waiting, Running, Loaded, Failed };
+
+  // Picks an entry whose dependencies are loaded, waiting for running loads if there is none yet.
+  // Returns false once no entry is left to load.
+  bool next(boost::mutex::scoped_lock& lock, size_t& index)
+  {
+    for (;;)
+    {
+      bool waiting = false;
+      bool failed = false;
+      for (size_t i = 0; i < states_.size() && !failed; ++i)
+      {
+        if (states_[i] != Waiting)
+        {
+          continue;
+        }
+
+        switch (checkDependencies(i))
+        {
+        case Loaded:
+          states_[i] = Running;
+          index = i;
+          return true;
+        case Failed:
+          states_[i] = Failed;
+          failed = true; // May unblock the decision on an earlier entry
+          break;
+        default:
+          waiting = true;
+        }
+      }
+
+      if (failed)
+      {
+        continue;
+      }
+
+      if (!waiting)
+      {
+        return false;
+      }
+
+      if (running_ == 0)
+      {
+        // Nothing running could satisfy the entries left, so they depend on each other
+        for (size_t i = 0; i < states_.size(); ++i)
+        {
+          if (states_[i] == Waiting)
+          {
+            ROS_ERROR("Not loading nodelet %s: circular dependency", requests_[i].name.c_str());
+            states_[i] = Failed;
+          }
+        }
+        return false;
+      }
+
+      cond_.wait(lock);
+    }
+  }
+
+  // Loaded if entry i can be loaded now, Failed if it never can, Waiting otherwise
+  State checkDependencies(size_t i)
+  {
+    const V_string& depends = requests_[i].depends;
+    for (size_t j = 0; j < depends.size(); ++j)
+    {
+      std::map<std::string, size_t>::const_iterator it = indices_.find(depends[j]);
+      if (it == indices_.end())
+      {
+        if (loaded_.count(depends[j]) == 0)
+        {
+          ROS_ERROR("Not loading nodelet %s: it depends on %s, which is not loaded", requests_[i].name.c_str(),
+                    depends[j].c_str());
+          return Failed;
+        }
+        continue;
+      }
+
+      State state = states_[it->second];
+      if (state == Failed)
+      {
+        ROS_ERROR("Not loading nodelet %s: it depends on %s, which failed to load", requests_[i].name.c_str(),
+                  depends[j].c_str());
+        return Failed;
+      }
+      if (state != Loaded)
+      {
+        return Waiting;
+      }
+    }
+
+    return Loaded;
+  }
+
+  Loader* loader_;
+  const std::vector<Loader::LoadRequest>& requests_;
+  std::map<std::string, size_t> indices_; ///<! Request index by nodelet name
+  std::set<std::string> loaded_;          ///<! Nodelets loaded before the call
+
+  boost::mutex mutex_;
+  boost::condition_variable cond_; ///<! Signalled when a load finishes
+  std::vector<State> states_;
+  uint32_t running_;
+};
+
+std::vector<bool> Loader::loadMany(const std::vector<LoadRequest>& requests, uint32_t num_threads)
+{
+  ros::WallTime start = ros::WallTime::now();
+
+  if (num_threads == 0)
+  {
+    num_threads = boost::thread::hardware_concurrency();
+  }
+  num_threads = std::max<uint32_t>(1, std::min<size_t>(num_threads, requests.size()));
+
+  LoadManyScheduler scheduler(this, requests);
+  boost::thread_group threads;
+  for (uint32_t i = 0; i < num_threads; ++i)
+  {
+    threads.create_thread(boost::bind(&LoadManyScheduler::run, &scheduler));
+  }
+  threads.join_all();
+
+  std::vector<bool> results = scheduler.results();
+  size_t loaded = std::count(results.begin(), results.end(), true);
+  ROS_INFO("Loaded %u of %u nodelets in %.3f seconds using %u threads.", (uint32_t)loaded,
+           (uint32_t)requests.size(), (ros::WallTime::now() - start).toSec(), num_threads);
+
+  return results;
+}
+
+bool Loader::addPool(const std::string& name, uint32_t num_threads)
+{
+  boost::unique_lock<boost::shared_mutex> lock(impl_->lock_);
+  if (impl_->pools_.count(name) > 0)
+  {
+    ROS_ERROR("Cannot add worker pool %s for one exists with that name already", name.c_str());
+    return false;
+  }
+
+  impl_->pools_[name].reset(new detail::CallbackQueueManager(num_threads));
+  ROS_INFO("Added worker pool %s with %u threads.", name.c_str(), impl_->pools_[name]->getNumWorkerThreads());
+  return true;
+}
+
+// Reads a list of strings, or a single string, from the entry of a graph nodelet
+static bool getGraphStrings(XmlRpc::XmlRpcValue& value, const char* key, const std::string& name, V_string& out)
+{
+  if (value.getType() == XmlRpc::XmlRpcValue::TypeString)
+  {
+    out.push_back(value);
+    return true;
+  }
+
+  if (value.getType() == XmlRpc::XmlRpcValue::TypeArray)
+  {
+    for (int i = 0; i < value.size(); ++i)
+    {
+      if (value[i].getType() != XmlRpc::XmlRpcValue::TypeString)
+      {
+        ROS_ERROR("Bad %s of graph nodelet %s: expected a list of strings", key, name.c_str());
+        return false;
+      }
+      out.push_back(value[i]);
+    }
+    return true;
+  }
+
+  ROS_ERROR("Bad %s of graph nodelet %s: expected a list of strings", key, name.c_str());
+  return false;
+}
+
+// Fills in request from the entry of a graph nodelet, and sets its parameters
+static bool parseGraphNodelet(XmlRpc::XmlRpcValue& entry, Loader::LoadRequest& request)
+{
+  if (entry.getType() != XmlRpc::XmlRpcValue::TypeStruct || !entry.hasMember("name") || !entry.hasMember("type") ||
+      entry["name"].getType() != XmlRpc::XmlRpcValue::TypeString ||
+      entry["type"].getType() != XmlRpc::XmlRpcValue::TypeString)
   {
-    p = impl_->create_instance_(type);
+    ROS_ERROR("Bad graph nodelet: each needs at least a name and a type");
+    return false;
   }
-  catch (std::runtime_error& e)
+  request.name = ros::names::resolve(entry["name"]);
+  request.type = static_cast<std::string&>(entry["type"]);
+
+  if (entry.hasMember("remap"))
   {
-    // If we cannot refresh the nodelet cache, fail immediately
-    if(!impl_->refresh_classes_)
+    XmlRpc::XmlRpcValue& remap = entry["remap"];
+    if (remap.getType() != XmlRpc::XmlRpcValue::TypeStruct)
     {
-      ROS_ERROR("Failed to load nodelet [%s] of type [%s]: %s", name.c_str(), type.c_str(), e.what());
+      ROS_ERROR("Bad remap of graph nodelet %s: expected a map of names", request.name.c_str());
       return false;
     }
+    for (XmlRpc::XmlRpcValue::iterator it = remap.begin(); it != remap.end(); ++it)
+    {
+      if (it->second.getType() != XmlRpc::XmlRpcValue::TypeString)
+      {
+        ROS_ERROR("Bad remap of graph nodelet %s: expected a map of names", request.name.c_str());
+        return false;
+      }
+      request.remappings[ros::names::resolve(it->first)] = ros::names::resolve(it->second);
+    }
+  }
 
-    // otherwise, refresh the cache and try again.
-    try
+  if (entry.hasMember("args") && !getGraphStrings(entry["args"], "args", request.name, request.my_argv))
+  {
+    return false;
+  }
+
+  if (entry.hasMember("depends"))
+  {
+    V_string depends;
+    if (!getGraphStrings(entry["depends"], "depends", request.name, depends))
     {
-      impl_->refresh_classes_();
-      p = impl_->create_instance_(type);
+      return false;
     }
-    catch (std::runtime_error& e2)
+    for (size_t i = 0; i < depends.size(); ++i)
     {
-      // dlopen() can return inconsistent results currently (see
-      // https://sourceware.org/bugzilla/show_bug.cgi?id=17833), so make sure
-      // that we display the messages of both exceptions to the user.
-      ROS_ERROR("Failed to load nodelet [%s] of type [%s] even after refreshing the cache: %s", name.c_str(), type.c_str(), e2.what());
-      ROS_ERROR("The error before refreshing the cache was: %s", e.what());
+      request.depends.push_back(ros::names::resolve(depends[i]));
+    }
+  }
+
+  if (entry.hasMember("pool"))
+  {
+    if (entry["pool"].getType() != XmlRpc::XmlRpcValue::TypeString)
+    {
+      ROS_ERROR("Bad pool of graph nodelet %s: expected a name", request.name.c_str());
       return false;
     }
+    request.pool = static_cast<std::string&>(entry["pool"]);
+  }
+
+  if (entry.hasMember("params"))
+  {
+    request.params.reset(new XmlRpc::XmlRpcValue(entry["params"]));
   }
 
-  if (!p)
+  return true;
+}
+
+bool Loader::loadGraph(const XmlRpc::XmlRpcValue& graph_value, uint32_t num_threads)
+{
+  XmlRpc::XmlRpcValue graph = graph_value; // XmlRpcValue only looks up members when non-const
+  if (graph.getType() != XmlRpc::XmlRpcValue::TypeStruct || !graph.hasMember("nodelets") ||
+      graph["nodelets"].getType() != XmlRpc::XmlRpcValue::TypeArray)
   {
+    ROS_ERROR("Bad nodelet graph: expected a map with a list of nodelets");
     return false;
   }
-  ROS_DEBUG("Done loading nodelet %s", name.c_str());
 
-  ManagedNodelet* mn = new ManagedNodelet(p, impl_->callback_manager_.get());
-  impl_->nodelets_.insert(const_cast<std::string&>(name), mn); // mn now owned by boost::ptr_map
-  try {
-    p->init(name, remappings, my_argv, mn->st_queue.get(), mn->mt_queue.get());
-    /// @todo Can we delay processing the queues until Nodelet::onInit() returns?
+  if (graph.hasMember("pools"))
+  {
+    XmlRpc::XmlRpcValue& pools = graph["pools"];
+    if (pools.getType() != XmlRpc::XmlRpcValue::TypeStruct)
+    {
+      ROS_ERROR("Bad nodelet graph: expected pools to map names to thread counts");
+      return false;
+    }
+    for (XmlRpc::XmlRpcValue::iterator it = pools.begin(); it != pools.end(); ++it)
+    {
+      if (it->second.getType() != XmlRpc::XmlRpcValue::TypeInt || static_cast<int&>(it->second) < 0)
+      {
+        ROS_ERROR("Bad nodelet graph: expected pools to map names to thread counts");
+        return false;
+      }
+      // A pool left over from an earlier graph is simply reused
+      boost::shared_lock<boost::shared_mutex> lock(impl_->lock_);
+      if (impl_->pools_.count(it->first) > 0)
+      {
+        continue;
+      }
+      lock.unlock();
+      addPool(it->first, static_cast<int&>(it->second));
+    }
+  }
 
-    ROS_DEBUG("Done initing nodelet %s", name.c_str());
-  } catch(...) {
+  XmlRpc::XmlRpcValue& nodelets = graph["nodelets"];
+  std::vector<LoadRequest> requests(nodelets.size());
+  for (int i = 0; i < nodelets.size(); ++i)
+  {
+    if (!parseGraphNodelet(nodelets[i], requests[i]))
+    {
+      return false;
+    }
+  }
+
+  std::vector<bool> results = loadMany(requests, num_threads);
+  return std::find(results.begin(), results.end(), false) == results.end();
+}
+
+bool Loader::unload (const std::string & name)
+{
+  // Take the nodelet out under the lock, but destroy it outside so loads aren't held up
+  Impl::M_stringToNodelet::auto_type mn;
+  {
+    boost::unique_lock<boost::shared_mutex> lock(impl_->lock_);
     Impl::M_stringToNodelet::iterator it = impl_->nodelets_.find(name);
-    if (it != impl_->nodelets_.end())
+    if (it == impl_->nodelets_.end())
     {
-      impl_->nodelets_.erase(it);
-      ROS_DEBUG ("Failed to initialize nodelet %s", name.c_str ());
       return (false);
     }
+    mn = impl_->nodelets_.release(it);
   }
+
+  uint64_t count;
+  double mean, max;
+  mn->getLatency(count, mean, max);
+  mn.reset();
+  ROS_DEBUG ("Done unloading nodelet %s (%llu callbacks, queue latency mean %.6fs, max %.6fs)", name.c_str (),
+             (unsigned long long)count, mean, max);
+  return (true);
+}
+
+bool Loader::reload(const std::string& name, const std::string& type)
+{
+  ros::WallTime start = ros::WallTime::now();
+
+  // Reserve the name like load() does, so it isn't reloaded twice at once
+  LoadRequest request;
+  detail::CallbackQueueManager* cqm;
+  {
+    boost::unique_lock<boost::shared_mutex> lock(impl_->lock_);
+    Impl::M_stringToNodelet::iterator it = impl_->nodelets_.find(name);
+    if (it == impl_->nodelets_.end() || impl_->loading_.count(name) > 0)
+    {
+      ROS_ERROR("Cannot reload nodelet %s: it isn't loaded, or is being reloaded already", name.c_str());
+      return false;
+    }
+
+    const ManagedNodelet& old = *it->second;
+    request.name = name;
+    request.type = type.empty() ? old.type : type;
+    request.remappings = old.remappings;
+    request.my_argv = old.my_argv;
+    request.pool = old.pool;
+    cqm = old.callback_manager;
+    impl_->loading_.insert(name);
+  }
+
+  // The old instance keeps running meanwhile.  Topics the new one advertises or subscribes to are
+  // shared with the old one within this process, so their connections stay up.  The new one's
+  // callbacks are held back until the switch, so the two never handle the same messages.
+  ManagedNodelet* mn = impl_->instantiate(request, cqm, true);
+
+  Impl::M_stringToNodelet::auto_type old;
+  detail::CallbackQueuePtr st_queue, mt_queue;
+  {
+    boost::unique_lock<boost::shared_mutex> lock(impl_->lock_);
+    impl_->loading_.erase(name);
+    if (!mn)
+    {
+      ROS_ERROR("Failed to reload nodelet %s, keeping the running instance", name.c_str());
+      return false;
+    }
+
+    Impl::M_stringToNodelet::iterator it = impl_->nodelets_.find(name);
+    if (it != impl_->nodelets_.end())
+    {
+      st_queue = mn->st_queue;
+      mt_queue = mn->mt_queue;
+      old = impl_->nodelets_.replace(it, mn);
+      mn = NULL;
+    }
+  }
+
+  if (mn)
+  {
+    ROS_ERROR("Nodelet %s was unloaded while it was being reloaded", name.c_str());
+    delete mn;
+    return false;
+  }
+
+  // Switch over: stop calling the old instance, then call the new one.  The callbacks the new one got
+  // until then were the old one's to handle, or to drop with the rest of its queue.
+  ros::WallTime handover = ros::WallTime::now();
+  old->drain();
+  st_queue->discardAddedBefore(handover);
+  mt_queue->discardAddedBefore(handover);
+  cqm->resumeQueue(st_queue);
+  cqm->resumeQueue(mt_queue);
+
+  // Destroy the old instance outside the lock
+  old.reset();
+  ROS_INFO("Reloaded nodelet %s as %s in %.3f seconds.", name.c_str(), request.type.c_str(),
+           (ros::WallTime::now() - start).toSec());
   return true;
 }
 
-bool Loader::unload (const std::string & name)
+bool Loader::unloadDetached(const std::string& name, double drain_timeout)
 {
-  boost::mutex::scoped_lock lock (lock_);
-  Impl::M_stringToNodelet::iterator it = impl_->nodelets_.find(name);
-  if (it != impl_->nodelets_.end())
+  boost::shared_ptr<ManagedNodelet> mn;
   {
-    impl_->nodelets_.erase(it);
-    ROS_DEBUG ("Done unloading nodelet %s", name.c_str ());
-    return (true);
+    boost::unique_lock<boost::shared_mutex> lock(impl_->lock_);
+    Impl::M_stringToNodelet::iterator it = impl_->nodelets_.find(name);
+    if (it == impl_->nodelets_.end())
+    {
+      return false;
+    }
+    mn.reset(impl_->nodelets_.release(it).release());
+
+    // Keep the name until the nodelet is gone, so that no other instance runs under it meanwhile
+    impl_->loading_.insert(name);
+  }
+
+  boost::shared_ptr<boost::promise<void> > drained(new boost::promise<void>);
+  boost::unique_future<void> future = drained->get_future();
+  if (!impl_->reap_pool_.post(boost::bind(&Impl::reap, this, mn, name, drain_timeout, drained)))
+  {
+    Impl::reap(this, mn, name, drain_timeout, drained);
+    return true;
   }
 
-  return (false);
+  if (!future.timed_wait(boost::posix_time::microseconds((int64_t)(drain_timeout * 1e6))))
+  {
+    ROS_WARN("Nodelet %s is still running callbacks %.3f seconds after it was unloaded; destroying it in the "
+             "background once they return.", name.c_str(), drain_timeout);
+  }
+  return true;
 }
 
 bool Loader::clear ()
 {
-  boost::mutex::scoped_lock lock(lock_);
-  impl_->nodelets_.clear();
+  Impl::M_stringToNodelet nodelets;
+  {
+    boost::unique_lock<boost::shared_mutex> lock(impl_->lock_);
+    nodelets.swap(impl_->nodelets_);
+  }
+  nodelets.clear();
   return true;
 };
 
 std::vector<std::string> Loader::listLoadedNodelets()
 {
-  boost::mutex::scoped_lock lock (lock_);
+  boost::shared_lock<boost::shared_mutex> lock(impl_->lock_);
   std::vector<std::string> output;
   Impl::M_stringToNodelet::iterator it = impl_->nodelets_.begin();
   for (; it != impl_->nodelets_.end(); ++it)
@@ -361,5 +1547,33 @@ std::vector<std::string> Loader::listLoadedNodelets()
   return output;
 }
 
+std::vector<Loader::NodeletInfo> Loader::listNodeletInfo()
+{
+  boost::shared_lock<boost::shared_mutex> lock(impl_->lock_);
+  std::vector<NodeletInfo> output;
+  Impl::M_stringToNodelet::iterator it = impl_->nodelets_.begin();
+  for (; it != impl_->nodelets_.end(); ++it)
+  {
+    NodeletInfo info;
+    info.name = it->first;
+    it->second->getInfo(info);
+    output.push_back(info);
+  }
+  return output;
+}
+
+bool Loader::getCallbackQueueLatency(const std::string& name, uint64_t& count, double& mean, double& max)
+{
+  boost::shared_lock<boost::shared_mutex> lock(impl_->lock_);
+  Impl::M_stringToNodelet::iterator it = impl_->nodelets_.find(name);
+  if (it == impl_->nodelets_.end())
+  {
+    return false;
+  }
+
+  it->second->getLatency(count, mean, max);
+  return true;
+}
+
 } // namespace nodelet
 
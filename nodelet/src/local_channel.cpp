@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2010, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <nodelet/local_channel.h>
+
+#include <ros/callback_queue.h>
+#include <boost/lexical_cast.hpp>
+#include <boost/weak_ptr.hpp>
+
+#include <algorithm>
+#include <map>
+#include <new>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nodelet
+{
+namespace detail
+{
+
+namespace
+{
+
+struct ChannelEntry
+{
+  std::string type;
+  boost::weak_ptr<LocalChannelBase> channel;
+};
+typedef std::map<std::string, ChannelEntry> M_ChannelEntry;
+
+// Lives in nodeletlib so that nodelets from different libraries share the same channels
+boost::mutex g_channels_mutex;
+M_ChannelEntry g_channels;
+
+const uint32_t SEGMENT_MAGIC = 0x6e6f646c; // "nodl"
+const size_t SEGMENT_DATA_OFFSET = 64;
+const uint64_t SEGMENT_MIN_CAPACITY = 1 << 20;
+const uint32_t MESSAGE_ALIGNMENT = 8;
+
+// At the start of each shared memory segment, followed by the data at SEGMENT_DATA_OFFSET
+struct SegmentHeader
+{
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t capacity;
+  // Bytes reserved for messages so far, including padding at the end of the data area
+  boost::atomic<uint64_t> head;
+};
+
+boost::atomic<uint32_t> g_next_writer(0);
+
+// Segment names are also made up of the pid and a per-process count, which repeat across PID
+// namespaces and after a crash, so they end in something random too.  create() refuses to reuse
+// an existing name and picks another.
+std::string makeSegmentName()
+{
+  uint32_t writer = g_next_writer++;
+  uint64_t seed = ros::WallTime::now().toNSec() ^ ((uint64_t)getpid() << 32) ^ ((uint64_t)writer << 16);
+  // splitmix64 finalizer, so that names made close together don't look alike
+  seed ^= seed >> 30;
+  seed *= 0xbf58476d1ce4e5b9ull;
+  seed ^= seed >> 27;
+  seed *= 0x94d049bb133111ebull;
+  seed ^= seed >> 31;
+
+  char suffix[17];
+  snprintf(suffix, sizeof(suffix), "%016llx", (unsigned long long)seed);
+  return "/nodelet_" + boost::lexical_cast<std::string>(getpid()) + "_" +
+         boost::lexical_cast<std::string>(writer) + "_" + suffix;
+}
+
+} // namespace
+
+LocalChannelBasePtr getLocalChannel(const std::string& topic, const std::type_info& type,
+                                    const boost::function<LocalChannelBasePtr()>& create)
+{
+  boost::mutex::scoped_lock lock(g_channels_mutex);
+
+  M_ChannelEntry::iterator it = g_channels.find(topic);
+  if (it != g_channels.end())
+  {
+    LocalChannelBasePtr channel = it->second.channel.lock();
+    if (channel)
+    {
+      // type_info objects may be duplicated across libraries, so compare by name
+      if (it->second.type != type.name())
+      {
+        throw Exception("Local channel [" + topic + "] is already in use with a different message type");
+      }
+
+      return channel;
+    }
+  }
+
+  // Drop channels that nobody uses any more while we're here
+  for (M_ChannelEntry::iterator e = g_channels.begin(); e != g_channels.end();)
+  {
+    if (e->second.channel.expired())
+    {
+      g_channels.erase(e++);
+    }
+    else
+    {
+      ++e;
+    }
+  }
+
+  LocalChannelBasePtr channel = create();
+  ChannelEntry& entry = g_channels[topic];
+  entry.type = type.name();
+  entry.channel = channel;
+  return channel;
+}
+
+SharedMemoryWriter::SharedMemoryWriter()
+: base_(NULL)
+, mapped_size_(0)
+, capacity_(0)
+, head_(0)
+{
+  name_ = makeSegmentName();
+}
+
+SharedMemoryWriter::~SharedMemoryWriter()
+{
+  destroy();
+}
+
+uint8_t* SharedMemoryWriter::reserve(uint32_t size, uint32_t min_messages, NodeletSharedMessage& msg)
+{
+  uint64_t aligned = (size + MESSAGE_ALIGNMENT - 1) / MESSAGE_ALIGNMENT * MESSAGE_ALIGNMENT;
+  // Twice as much as needed, as the padding at the end of the data area can waste almost a message
+  uint64_t needed = 2 * aligned * std::max(min_messages, 1u);
+  if (!base_ || capacity_ < needed)
+  {
+    uint64_t capacity = std::max(capacity_, SEGMENT_MIN_CAPACITY);
+    while (capacity < needed)
+    {
+      capacity *= 2;
+    }
+
+    destroy();
+    if (!create(capacity))
+    {
+      return NULL;
+    }
+  }
+
+  // Messages don't wrap around, skip to the start of the data area instead
+  uint64_t offset = head_ % capacity_;
+  if (offset + aligned > capacity_)
+  {
+    head_ += capacity_ - offset;
+    offset = 0;
+  }
+
+  msg.segment = name_ + "_" + boost::lexical_cast<std::string>(capacity_);
+  msg.position = head_;
+  msg.size = size;
+
+  // Let readers know before overwriting anything
+  head_ += aligned;
+  SegmentHeader* header = reinterpret_cast<SegmentHeader*>(base_);
+  header->head.store(head_);
+  boost::atomic_thread_fence(boost::memory_order_seq_cst);
+
+  return base_ + SEGMENT_DATA_OFFSET + offset;
+}
+
+bool SharedMemoryWriter::create(uint64_t capacity)
+{
+  // Each size gets its own name, so readers notice the segment was replaced.  Never open a segment
+  // that is already there: it belongs to someone else, who may still be using it.
+  std::string name = name_ + "_" + boost::lexical_cast<std::string>(capacity);
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  for (int attempt = 0; fd < 0 && errno == EEXIST && attempt < 8; ++attempt)
+  {
+    name_ = makeSegmentName();
+    name = name_ + "_" + boost::lexical_cast<std::string>(capacity);
+    fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  }
+  if (fd < 0)
+  {
+    ROS_ERROR("Failed to create shared memory segment %s: %s", name.c_str(), strerror(errno));
+    return false;
+  }
+
+  size_t mapped_size = SEGMENT_DATA_OFFSET + capacity;
+  void* base = MAP_FAILED;
+  if (ftruncate(fd, mapped_size) == 0)
+  {
+    base = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+
+  if (base == MAP_FAILED)
+  {
+    ROS_ERROR("Failed to map shared memory segment %s of %lu bytes: %s", name.c_str(),
+              (unsigned long)mapped_size, strerror(errno));
+    shm_unlink(name.c_str());
+    return false;
+  }
+
+  base_ = static_cast<uint8_t*>(base);
+  mapped_size_ = mapped_size;
+  capacity_ = capacity;
+  head_ = 0;
+
+  SegmentHeader* header = new (base_) SegmentHeader;
+  header->magic = SEGMENT_MAGIC;
+  header->reserved = 0;
+  header->capacity = capacity;
+  header->head.store(0);
+  return true;
+}
+
+void SharedMemoryWriter::destroy()
+{
+  if (!base_)
+  {
+    return;
+  }
+
+  // Readers that have it mapped keep it until they move on to the next one
+  std::string name = name_ + "_" + boost::lexical_cast<std::string>(capacity_);
+  munmap(base_, mapped_size_);
+  shm_unlink(name.c_str());
+  base_ = NULL;
+  mapped_size_ = 0;
+}
+
+SharedMemoryReader::SharedMemoryReader()
+: base_(NULL)
+, mapped_size_(0)
+, denied_(false)
+{
+}
+
+SharedMemoryReader::~SharedMemoryReader()
+{
+  unmap();
+}
+
+const uint8_t* SharedMemoryReader::get(const NodeletSharedMessage& msg)
+{
+  if (!base_ || msg.segment != name_)
+  {
+    unmap();
+
+    int fd = shm_open(msg.segment.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+    {
+      // Otherwise it's most likely been replaced by a larger one already
+      denied_ = (errno == EACCES);
+      return NULL;
+    }
+
+    struct stat st;
+    void* base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size > SEGMENT_DATA_OFFSET)
+    {
+      base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (base == MAP_FAILED)
+    {
+      return NULL;
+    }
+
+    const SegmentHeader* header = static_cast<const SegmentHeader*>(base);
+    if (header->magic != SEGMENT_MAGIC || SEGMENT_DATA_OFFSET + header->capacity > (uint64_t)st.st_size)
+    {
+      munmap(base, st.st_size);
+      return NULL;
+    }
+
+    name_ = msg.segment;
+    base_ = static_cast<const uint8_t*>(base);
+    mapped_size_ = st.st_size;
+  }
+
+  const SegmentHeader* header = reinterpret_cast<const SegmentHeader*>(base_);
+  uint64_t offset = msg.position % header->capacity;
+  if (offset + msg.size > header->capacity || !valid(msg))
+  {
+    return NULL;
+  }
+
+  return base_ + SEGMENT_DATA_OFFSET + offset;
+}
+
+bool SharedMemoryReader::valid(const NodeletSharedMessage& msg) const
+{
+  // The message is intact as long as the writer hasn't reserved anything a whole segment past it
+  boost::atomic_thread_fence(boost::memory_order_seq_cst);
+  const SegmentHeader* header = reinterpret_cast<const SegmentHeader*>(base_);
+  return header->head.load() <= msg.position + header->capacity;
+}
+
+void SharedMemoryReader::unmap()
+{
+  if (base_)
+  {
+    munmap(const_cast<uint8_t*>(base_), mapped_size_);
+    base_ = NULL;
+    mapped_size_ = 0;
+    name_.clear();
+  }
+}
+
+std::string getSharedMemoryTopic(const std::string& topic)
+{
+  // Only processes on the same host subscribe to it
+  std::string host = ros::network::getHost();
+  for (size_t i = 0; i < host.size(); ++i)
+  {
+    if (!isalnum(host[i]))
+    {
+      host[i] = '_';
+    }
+  }
+
+  return topic + "/shm_" + host;
+}
+
+ros::CallbackQueueInterface* getSharedMemoryQueue()
+{
+  // Never destroyed, the spinner thread may still be running when static destructors are
+  static boost::mutex mutex;
+  static ros::CallbackQueue* queue = NULL;
+  boost::mutex::scoped_lock lock(mutex);
+  if (!queue)
+  {
+    queue = new ros::CallbackQueue;
+    ros::AsyncSpinner* spinner = new ros::AsyncSpinner(1, queue);
+    spinner->start();
+  }
+
+  return queue;
+}
+
+} // namespace detail
+} // namespace nodelet
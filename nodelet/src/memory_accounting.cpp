@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2010, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <nodelet/detail/memory_accounting.h>
+
+#include <new>
+#include <stdlib.h>
+
+namespace nodelet
+{
+namespace detail
+{
+
+// Plain data, so these are usable before static constructors run, as the first allocations are
+static bool g_memory_accounting = false;
+// Not boost::thread_specific_ptr, which may allocate, and is too slow to ask on every allocation
+static __thread MemoryAccount* t_current_account = NULL;
+
+void enableMemoryAccounting()
+{
+  g_memory_accounting = true;
+}
+
+bool isMemoryAccountingEnabled()
+{
+  return g_memory_accounting;
+}
+
+MemoryAccount* createMemoryAccount()
+{
+  if (!g_memory_accounting)
+  {
+    return NULL;
+  }
+
+  // Taken from malloc() so that the account isn't charged to the nodelet that happens to be running
+  void* memory = malloc(sizeof(MemoryAccount));
+  if (!memory)
+  {
+    return NULL;
+  }
+  return new (memory) MemoryAccount;
+}
+
+void releaseMemoryAccount(MemoryAccount* account)
+{
+  if (!account || account->references.fetch_sub(1) != 1)
+  {
+    return;
+  }
+
+  account->~MemoryAccount();
+  free(account);
+}
+
+MemoryAccount* getCurrentMemoryAccount()
+{
+  return t_current_account;
+}
+
+MemoryAccountScope::MemoryAccountScope(MemoryAccount* account)
+: account_(account)
+, outer_(NULL)
+{
+  if (account_)
+  {
+    outer_ = t_current_account;
+    t_current_account = account_;
+  }
+}
+
+MemoryAccountScope::~MemoryAccountScope()
+{
+  if (account_)
+  {
+    t_current_account = outer_;
+  }
+}
+
+} // namespace detail
+} // namespace nodelet
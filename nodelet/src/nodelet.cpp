@@ -42,7 +42,12 @@
 
 @b nodeletcpp is a tool for loading/unloading nodelets to/from a Nodelet manager.
 **/
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <string.h>
+#include <unistd.h>
 #include <uuid/uuid.h>
 
 #include <ros/ros.h>
@@ -51,6 +56,7 @@
 #include "nodelet/loader.h"
 #include "nodelet/NodeletList.h"
 #include "nodelet/NodeletLoad.h"
+#include "nodelet/NodeletLoadBatch.h"
 #include "nodelet/NodeletUnload.h"
 
 std::string genId()
@@ -71,7 +77,9 @@ class NodeletArgumentParsing
     std::string default_name_;
     std::string manager_;
     std::vector<std::string> local_args_;
+    std::vector<std::pair<std::string, std::string> > group_;
     bool is_bond_enabled_;
+    int num_worker_threads_;
   
   public:
     //NodeletArgumentParsing() { };
@@ -79,6 +87,7 @@ class NodeletArgumentParsing
       parseArgs(int argc, char** argv)
     {
       is_bond_enabled_ = true;
+      num_worker_threads_ = -1;
       std::vector<std::string> non_ros_args;
       ros::removeROSArgs (argc, argv, non_ros_args);
       size_t used_args = 0;
@@ -111,14 +120,54 @@ class NodeletArgumentParsing
         manager_ = non_ros_args[3];
         used_args = 4;
       }
+      else if (command_ == "load-group" && non_ros_args.size() > 2)
+      {
+        default_name_ = "nodelet_load_group";
+        manager_ = non_ros_args[2];
+        used_args = 3;
+
+        if (non_ros_args.size() > used_args && non_ros_args[used_args] == "--no-bond")
+        {
+          is_bond_enabled_ = false;
+          ++used_args;
+        }
+
+        for (; used_args + 1 < non_ros_args.size(); used_args += 2)
+          group_.push_back(std::make_pair(non_ros_args[used_args], non_ros_args[used_args + 1]));
+
+        // Names and types come in pairs
+        if (group_.empty() || used_args < non_ros_args.size())
+          return false;
+      }
       else if (command_ == "standalone" && non_ros_args.size() > 2)
       {
-        type_ = non_ros_args[2];
+        // Options come before the type, everything after it belongs to the nodelet
+        used_args = 2;
+        while (used_args < non_ros_args.size())
+        {
+          if (non_ros_args[used_args] == "--num-worker-threads" && used_args + 1 < non_ros_args.size())
+          {
+            num_worker_threads_ = atoi(non_ros_args[used_args + 1].c_str());
+            if (num_worker_threads_ < 0)
+              return false;
+            used_args += 2;
+          }
+          else if (non_ros_args[used_args] == "--with" && used_args + 2 < non_ros_args.size())
+          {
+            group_.push_back(std::make_pair(non_ros_args[used_args + 1], non_ros_args[used_args + 2]));
+            used_args += 3;
+          }
+          else
+            break;
+        }
+
+        if (used_args >= non_ros_args.size())
+          return false;
+        type_ = non_ros_args[used_args++];
         printf("type is %s\n", type_.c_str());
-        used_args = 3;
       }
 
-      if (command_ == "manager")
+      if (command_ == "manager" || command_ == "graph")
         used_args = 2;
 
       for (size_t i = used_args; i < non_ros_args.size(); i++)
@@ -135,11 +184,16 @@ class NodeletArgumentParsing
     std::string getType () const    { return (type_);    }
     std::string getName () const    { return (name_);    }
     std::string getManager() const  { return (manager_); }
+    const std::vector<std::pair<std::string, std::string> >& getGroup() const { return group_; }
     bool isBondEnabled() const { return is_bond_enabled_; }
+    /// Worker threads given on the command line, or -1
+    int getNumWorkerThreads() const { return num_worker_threads_; }
 
     std::vector<std::string> getMyArgv () const {return local_args_;};
     std::string getDefaultName()
     {
+      if (!default_name_.empty())
+        return default_name_;
       std::string s = type_;
       replace(s.begin(), s.end(), '/', '_');
       return s;
@@ -202,11 +256,10 @@ class NodeletInterface
         ROS_INFO_STREAM (sources[i] << " -> " << targets[i]);
       }
 
-      // Get and set the parameters
+      // Get the parameters
       XmlRpc::XmlRpcValue param;
       std::string node_name = ros::this_node::getName ();
       n_.getParam (node_name, param);
-      n_.setParam (name, param);
 
       std::string service_name = std::string (manager) + "/load_nodelet";
 
@@ -215,6 +268,32 @@ class NodeletInterface
       ros::ServiceClient client = n_.serviceClient<nodelet::NodeletLoad> (service_name);
       client.waitForExistence ();
 
+      // NodeletLoad has no room for the parameters, so hand them over in a batch of one, for the
+      // manager to set and serve to the nodelet.  Managers without batch loads get them through
+      // the master as before.
+      std::string batch_service_name = std::string (manager) + "/load_nodelet_batch";
+      if (param.valid () && ros::service::exists (batch_service_name, false))
+      {
+        nodelet::NodeletLoadBatch srv;
+        srv.request.nodelets.resize (1);
+        nodelet::NodeletLoadEntry &entry = srv.request.nodelets[0];
+        entry.name = name;
+        entry.type = type;
+        entry.remap_source_args = sources;
+        entry.remap_target_args = targets;
+        entry.my_argv = args;
+        entry.bond_id = bond_id;
+        entry.params = param.toXml ();
+        ros::ServiceClient batch_client = n_.serviceClient<nodelet::NodeletLoadBatch> (batch_service_name);
+        if (!batch_client.call (srv) || srv.response.success.size () != 1 || !srv.response.success[0])
+        {
+          ROS_FATAL_STREAM("Failed to load nodelet '" << name << "` of type `" << type << "` to manager `" << manager << "'");
+          return false;
+        }
+        return true;
+      }
+      n_.setParam (name, param);
+
       // Call the service
       nodelet::NodeletLoad srv;
       srv.request.name = std::string (name);
@@ -230,6 +309,68 @@ class NodeletInterface
       }
       return true;
     }
+    ////////////////////////////////////////////////////////////////////////////////
+    /** \brief Load several nodelets with one request, sharing one bond
+     * \param group Names and types of the nodelets. Each nodelet gets the parameters in the
+     * private namespace of this node under its name.
+     * \param loaded Set to the resolved names of the nodelets that loaded
+     */
+    bool
+      loadNodelets (const std::vector<std::pair<std::string, std::string> > &group,
+                    const std::string &manager, const std::string &bond_id,
+                    std::vector<std::string> &loaded)
+    {
+      ros::M_string remappings = ros::names::getRemappings ();
+      std::string node_name = ros::this_node::getName ();
+
+      nodelet::NodeletLoadBatch srv;
+      srv.request.nodelets.resize (group.size ());
+      for (size_t i = 0; i < group.size (); ++i)
+      {
+        nodelet::NodeletLoadEntry &entry = srv.request.nodelets[i];
+        entry.name = ros::names::resolve (group[i].first);
+        entry.type = group[i].second;
+        for (ros::M_string::iterator it = remappings.begin (); it != remappings.end (); ++it)
+        {
+          entry.remap_source_args.push_back (it->first);
+          entry.remap_target_args.push_back (it->second);
+        }
+        entry.bond_id = bond_id;
+
+        XmlRpc::XmlRpcValue param;
+        if (n_.getParam (node_name + "/" + group[i].first, param))
+          entry.params = param.toXml ();
+
+        ROS_INFO_STREAM ("Loading nodelet " << entry.name << " of type " << entry.type << " to manager " << manager);
+      }
+
+      std::string service_name = manager + "/load_nodelet_batch";
+      ROS_DEBUG ("Waiting for service %s to be available...", service_name.c_str ());
+      ros::ServiceClient client = n_.serviceClient<nodelet::NodeletLoadBatch> (service_name);
+      client.waitForExistence ();
+
+      if (!client.call (srv) || srv.response.success.size () != group.size ())
+      {
+        ROS_FATAL_STREAM("Failed to load nodelets to manager `" << manager << "'");
+        return false;
+      }
+
+      bool success = true;
+      for (size_t i = 0; i < group.size (); ++i)
+      {
+        if (srv.response.success[i])
+        {
+          loaded.push_back (srv.request.nodelets[i].name);
+        }
+        else
+        {
+          ROS_FATAL_STREAM("Failed to load nodelet '" << srv.request.nodelets[i].name << "` of type `"
+                           << srv.request.nodelets[i].type << "` to manager `" << manager << "'");
+          success = false;
+        }
+      }
+      return success;
+    }
   private:
     ros::NodeHandle n_;
 };
@@ -241,17 +382,49 @@ void print_usage(int argc, char** argv)
     printf("%s ", argv[i]);
   printf("\nnodelet usage:\n");
   printf("nodelet load pkg/Type manager [--no-bond]  - Launch a nodelet of type pkg/Type on manager manager\n");
-  printf("nodelet standalone pkg/Type   - Launch a nodelet of type pkg/Type in a standalone node\n");
+  printf("nodelet standalone [--num-worker-threads N] [--with name pkg/Type ...] pkg/Type  - Launch a nodelet of type pkg/Type in a standalone node,\n");
+  printf("                                along with other nodelets sharing its N worker threads\n");
+  printf("nodelet load-group manager [--no-bond] name pkg/Type [name pkg/Type ...]  - Launch several nodelets on manager from one process\n");
   printf("nodelet unload name manager   - Unload a nodelet by name from manager\n");
   printf("nodelet manager               - Launch a nodelet manager node\n");
+  printf("nodelet graph                 - Launch a nodelet manager node with the nodelet graph in its ~graph parameter\n");
 
 };
 
 sig_atomic_t volatile request_shutdown = 0;
 
+// Self-pipe the supervision loop of "nodelet load" sleeps on.  Writing to it is safe from signal
+// handlers, so signals, the shutdown XML-RPC call and the bond can all wake the loop.
+int supervisor_pipe[2] = { -1, -1 };
+
+bool initSupervisor()
+{
+  if (pipe(supervisor_pipe) != 0)
+    return false;
+  // Never block a signal handler on a full pipe; one pending byte is enough to wake the loop
+  fcntl(supervisor_pipe[1], F_SETFL, fcntl(supervisor_pipe[1], F_GETFL) | O_NONBLOCK);
+  return true;
+}
+
+void wakeSupervisor()
+{
+  char c = 0;
+  ssize_t written = write(supervisor_pipe[1], &c, 1);
+  (void)written;
+}
+
+// Sleeps until wakeSupervisor() is called, or returns at once if it was called since the last wait
+void waitSupervisor()
+{
+  char buffer[64];
+  ssize_t result = read(supervisor_pipe[0], buffer, sizeof(buffer));
+  (void)result; // Interrupted by a signal is just as good
+}
+
 void nodeletLoaderSigIntHandler(int)
 {
   request_shutdown = 1;
+  wakeSupervisor();
 }
 
 // Shutdown can be triggered externally by an XML-RPC call, this is how "rosnode kill"
@@ -268,11 +441,41 @@ void shutdownCallback(XmlRpc::XmlRpcValue& params, XmlRpc::XmlRpcValue& result)
     std::string reason = params[1];
     ROS_WARN("Shutdown request received. Reason: [%s]", reason.c_str());
     request_shutdown = 1;
+    wakeSupervisor();
   }
 
   result = ros::xmlrpc::responseInt(1, "", 0);
 }
 
+// Takes over shutdown handling from roscpp and runs until shutdown is requested or the bond
+// breaks.  Returns false if the bond broke, in which case the manager has unloaded the nodelets.
+bool supervise(bond::Bond& bond, bool is_bond_enabled)
+{
+  // Override default exit handlers for roscpp
+  signal(SIGINT, nodeletLoaderSigIntHandler);
+  ros::XMLRPCManager::instance()->unbind("shutdown");
+  ros::XMLRPCManager::instance()->bind("shutdown", shutdownCallback);
+
+  if (is_bond_enabled)
+  {
+    bond.setBrokenCallback(wakeSupervisor);
+    bond.start();
+  }
+  // Spin our own loop, sleeping until there is something to do
+  ros::AsyncSpinner spinner(1);
+  spinner.start();
+  while (!request_shutdown)
+  {
+    if (is_bond_enabled && bond.isBroken())
+    {
+      ROS_INFO("Bond broken, exiting");
+      return false;
+    }
+    waitSupervisor();
+  }
+  return true;
+}
+
 /* ---[ */
 int
   main (int argc, char** argv)
@@ -291,6 +494,24 @@ int
   {
     ros::init (argc, argv, "manager");
     nodelet::Loader n;
+    XmlRpc::XmlRpcValue graph;
+    if (ros::param::get("~graph", graph))
+      n.loadGraph(graph);
+    ros::spin ();
+  }
+  else if (command == "graph")
+  {
+    // Like a manager, but the graph is required and all of it must load
+    ros::init (argc, argv, "manager");
+    XmlRpc::XmlRpcValue graph;
+    if (!ros::param::get("~graph", graph))
+    {
+      ROS_FATAL("No nodelet graph in parameter %s", ros::names::resolve("~graph").c_str());
+      return -1;
+    }
+    nodelet::Loader n;
+    if (!n.loadGraph(graph))
+      return -1;
     ros::spin ();
   }
   else if (command == "standalone")
@@ -298,14 +519,33 @@ int
     ros::init (argc, argv, arg_parser.getDefaultName());
 
     ros::NodeHandle nh;
-    nodelet::Loader n(false);
-    ros::M_string remappings; //Remappings are already applied by ROS no need to generate them.
-    std::string nodelet_name = ros::this_node::getName ();
-    std::string nodelet_type = arg_parser.getType();
-    if(!n.load(nodelet_name, nodelet_type, remappings, arg_parser.getMyArgv()))
+    // All nodelets in the process share the worker threads, which may be set by command line
+    // or else by the ~num_worker_threads parameter
+    int num_worker_threads = arg_parser.getNumWorkerThreads();
+    if (num_worker_threads < 0)
+      ros::NodeHandle("~").param("num_worker_threads", num_worker_threads, 0);
+    nodelet::Loader n(false, std::max(num_worker_threads, 0));
+    // The first nodelet takes the name of the node, the others are named on the command line.
+    // Remappings are already applied by ROS no need to generate them.
+    std::vector<nodelet::Loader::LoadRequest> requests(1);
+    requests[0].name = ros::this_node::getName ();
+    requests[0].type = arg_parser.getType();
+    requests[0].my_argv = arg_parser.getMyArgv();
+    const std::vector<std::pair<std::string, std::string> >& group = arg_parser.getGroup();
+    for (size_t i = 0; i < group.size(); i++)
+    {
+      nodelet::Loader::LoadRequest request;
+      request.name = ros::names::resolve(group[i].first);
+      request.type = group[i].second;
+      requests.push_back(request);
+    }
+
+    std::vector<bool> success = n.loadMany(requests);
+    if (std::find(success.begin(), success.end(), false) != success.end())
       return -1;
 
-    ROS_DEBUG("Successfully loaded nodelet of type '%s' into name '%s'\n", nodelet_name.c_str(), nodelet_name.c_str());
+    for (size_t i = 0; i < requests.size(); i++)
+      ROS_DEBUG("Successfully loaded nodelet of type '%s' into name '%s'\n", requests[i].type.c_str(), requests[i].name.c_str());
 
     ros::spin();
   }
@@ -323,32 +563,51 @@ int
     bond::Bond bond(manager + "/bond", bond_id);
     if (!ni.loadNodelet(name, type, manager, arg_parser.getMyArgv(), bond_id))
       return -1;
+    if (!initSupervisor())
+    {
+      ROS_FATAL("Failed to create the supervision pipe: %s", strerror(errno));
+      return -1;
+    }
 
-    // Override default exit handlers for roscpp
-    signal(SIGINT, nodeletLoaderSigIntHandler);
-    ros::XMLRPCManager::instance()->unbind("shutdown");
-    ros::XMLRPCManager::instance()->bind("shutdown", shutdownCallback);
-    
-    if (arg_parser.isBondEnabled())
-      bond.start();
-    // Spin our own loop
-    ros::AsyncSpinner spinner(1);
-    spinner.start();
-    while (!request_shutdown)
+    if (supervise(bond, arg_parser.isBondEnabled()))
     {
-      if (arg_parser.isBondEnabled() && bond.isBroken())
-      {
-        ROS_INFO("Bond broken, exiting");
-        goto shutdown;
-      }
-      usleep(100000);
+      // Attempt to unload the nodelet before shutting down ROS
+      ni.unloadNodelet(name, manager);
+      if (arg_parser.isBondEnabled())
+        bond.breakBond();
     }
-    // Attempt to unload the nodelet before shutting down ROS
-    ni.unloadNodelet(name, manager);
+    ros::shutdown();
+  }
+  else if (command == "load-group")
+  {
+    ros::init (argc, argv, arg_parser.getDefaultName (), ros::init_options::NoSigintHandler);
+    NodeletInterface ni;
+    ros::NodeHandle nh;
+    std::string manager = arg_parser.getManager();
+    std::string bond_id;
     if (arg_parser.isBondEnabled())
-      bond.breakBond();
-  shutdown:
+      bond_id = ros::this_node::getName () + "_" + genId();
+    // One bond covers all the nodelets, the manager unloads all of them when it breaks
+    bond::Bond bond(manager + "/bond", bond_id);
+    std::vector<std::string> loaded;
+    bool success = ni.loadNodelets(arg_parser.getGroup(), manager, bond_id, loaded);
+    if (success && !initSupervisor())
+    {
+      ROS_FATAL("Failed to create the supervision pipe: %s", strerror(errno));
+      success = false;
+    }
+
+    if (!success || supervise(bond, arg_parser.isBondEnabled()))
+    {
+      // Attempt to unload the nodelets before shutting down ROS
+      for (size_t i = 0; i < loaded.size(); ++i)
+        ni.unloadNodelet(loaded[i], manager);
+      if (success && arg_parser.isBondEnabled())
+        bond.breakBond();
+    }
     ros::shutdown();
+    if (!success)
+      return -1;
   }
   else if (command == "unload")
   {
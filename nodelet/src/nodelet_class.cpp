@@ -28,6 +28,7 @@
  */
 
 #include <nodelet/nodelet.h>
+#include <nodelet/message_pool.h>
 #include <nodelet/detail/callback_queue.h>
 #include <nodelet/detail/callback_queue_manager.h>
 
@@ -37,9 +38,16 @@
 namespace nodelet
 {
 
+struct Nodelet::Impl
+{
+  boost::shared_ptr<XmlRpc::XmlRpcValue> params;
+  detail::MessagePools message_pools;
+};
+
 Nodelet::Nodelet ()
 : inited_(false)
 , nodelet_name_("uninitialized")
+, impl_(new Impl)
 {
 }
 
@@ -67,6 +75,11 @@ ros::CallbackQueueInterface& Nodelet::getMTCallbackQueue () const
   return *mt_nh_->getCallbackQueue();
 }
 
+ros::WallDuration Nodelet::getCurrentCallbackQueueLatency()
+{
+  return detail::CallbackQueue::getCurrentLatency();
+}
+
 ros::NodeHandle& Nodelet::getNodeHandle() const
 {
   if (!inited_)
@@ -104,8 +117,108 @@ ros::NodeHandle& Nodelet::getMTPrivateNodeHandle() const
   return *mt_private_nh_;
 }
 
+XmlRpc::XmlRpcValue* Nodelet::findLocalParam(const std::string& key) const
+{
+  // The parameters only cover the private namespace
+  if (!impl_->params || (!key.empty() && key[0] == '/'))
+  {
+    return NULL;
+  }
+
+  // Walk down the structs of the parameter tree, one name in the key at a time
+  XmlRpc::XmlRpcValue* value = impl_->params.get();
+  size_t start = 0;
+  while (start < key.size())
+  {
+    size_t end = key.find('/', start);
+    if (end == std::string::npos)
+    {
+      end = key.size();
+    }
+    if (end > start)
+    {
+      std::string member = key.substr(start, end - start);
+      if (value->getType() != XmlRpc::XmlRpcValue::TypeStruct || !value->hasMember(member))
+      {
+        return NULL;
+      }
+      value = &(*value)[member];
+    }
+    start = end + 1;
+  }
+
+  return value;
+}
+
+bool Nodelet::getLocalParam(const std::string& key, std::string& value) const
+{
+  XmlRpc::XmlRpcValue* param = findLocalParam(key);
+  if (param && param->getType() == XmlRpc::XmlRpcValue::TypeString)
+  {
+    value = static_cast<std::string&>(*param);
+    return true;
+  }
+  return getPrivateNodeHandle().getParam(key, value);
+}
+
+bool Nodelet::getLocalParam(const std::string& key, double& value) const
+{
+  XmlRpc::XmlRpcValue* param = findLocalParam(key);
+  if (param && param->getType() == XmlRpc::XmlRpcValue::TypeDouble)
+  {
+    value = static_cast<double&>(*param);
+    return true;
+  }
+  if (param && param->getType() == XmlRpc::XmlRpcValue::TypeInt)
+  {
+    value = static_cast<int&>(*param);
+    return true;
+  }
+  return getPrivateNodeHandle().getParam(key, value);
+}
+
+bool Nodelet::getLocalParam(const std::string& key, int& value) const
+{
+  XmlRpc::XmlRpcValue* param = findLocalParam(key);
+  if (param && param->getType() == XmlRpc::XmlRpcValue::TypeInt)
+  {
+    value = static_cast<int&>(*param);
+    return true;
+  }
+  return getPrivateNodeHandle().getParam(key, value);
+}
+
+bool Nodelet::getLocalParam(const std::string& key, bool& value) const
+{
+  XmlRpc::XmlRpcValue* param = findLocalParam(key);
+  if (param && param->getType() == XmlRpc::XmlRpcValue::TypeBoolean)
+  {
+    value = static_cast<bool&>(*param);
+    return true;
+  }
+  return getPrivateNodeHandle().getParam(key, value);
+}
+
+bool Nodelet::getLocalParam(const std::string& key, XmlRpc::XmlRpcValue& value) const
+{
+  XmlRpc::XmlRpcValue* param = findLocalParam(key);
+  if (param)
+  {
+    value = *param;
+    return true;
+  }
+  return getPrivateNodeHandle().getParam(key, value);
+}
+
 void Nodelet::init(const std::string& name, const M_string& remapping_args, const V_string& my_argv,
                    ros::CallbackQueueInterface* st_queue, ros::CallbackQueueInterface* mt_queue)
+{
+  init(name, remapping_args, my_argv, st_queue, mt_queue, NULL);
+}
+
+void Nodelet::init(const std::string& name, const M_string& remapping_args, const V_string& my_argv,
+                   ros::CallbackQueueInterface* st_queue, ros::CallbackQueueInterface* mt_queue,
+                   const XmlRpc::XmlRpcValue* params)
 {
   if (inited_)
   {
@@ -114,6 +227,10 @@ void Nodelet::init(const std::string& name, const M_string& remapping_args, cons
 
   nodelet_name_ = name;
   my_argv_ = my_argv;
+  if (params)
+  {
+    impl_->params.reset(new XmlRpc::XmlRpcValue(*params));
+  }
 
   // Set up NodeHandles with correct namespaces
   private_nh_.reset(new ros::NodeHandle(name, remapping_args));
@@ -133,4 +250,21 @@ void Nodelet::init(const std::string& name, const M_string& remapping_args, cons
   this->onInit ();
 }
 
+detail::MessagePools& Nodelet::getMessagePools() const
+{
+  return impl_->message_pools;
+}
+
+std::vector<MessagePoolStats> Nodelet::getMessagePoolStats() const
+{
+  std::vector<MessagePoolStats> stats;
+  boost::mutex::scoped_lock lock(impl_->message_pools.mutex);
+  for (detail::MessagePools::M_Pool::const_iterator it = impl_->message_pools.pools.begin();
+       it != impl_->message_pools.pools.end(); ++it)
+  {
+    stats.push_back(it->second->getStats());
+  }
+  return stats;
+}
+
 } // namespace nodelet
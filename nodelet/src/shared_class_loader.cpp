@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2010, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <nodelet/detail/shared_class_loader.h>
+#include <nodelet/detail/class_index.h>
+
+#include <ros/console.h>
+
+namespace nodelet
+{
+namespace detail
+{
+
+boost::mutex SharedClassLoader::registry_mutex_;
+boost::weak_ptr<SharedClassLoader> SharedClassLoader::registry_;
+
+boost::shared_ptr<SharedClassLoader> SharedClassLoader::get()
+{
+  boost::mutex::scoped_lock lock(registry_mutex_);
+  boost::shared_ptr<SharedClassLoader> shared = registry_.lock();
+  if (!shared)
+  {
+    shared.reset(new SharedClassLoader);
+    registry_ = shared;
+  }
+  return shared;
+}
+
+void SharedClassLoader::refresh()
+{
+  loader->refreshDeclaredClasses();
+  updateClassIndex();
+}
+
+SharedClassLoader::SharedClassLoader()
+{
+  // Hand pluginlib the plugin description files from the class index if that is up to date,
+  // so it doesn't have to crawl all packages for them
+  std::vector<std::string> plugin_xml_paths;
+  ClassIndex index;
+  if (index.load())
+  {
+    plugin_xml_paths = index.getPluginXmlPaths();
+  }
+
+  loader.reset(new ClassLoader("nodelet", "nodelet::Nodelet", "plugin", plugin_xml_paths));
+  if (plugin_xml_paths.empty())
+  {
+    updateClassIndex();
+  }
+}
+
+void SharedClassLoader::updateClassIndex()
+{
+  std::vector<ClassIndex::Class> classes;
+  std::vector<std::string> types = loader->getDeclaredClasses();
+  for (size_t i = 0; i < types.size(); ++i)
+  {
+    ClassIndex::Class c;
+    c.type = types[i];
+    c.plugin_xml = loader->getPluginManifestPath(types[i]);
+    c.library = loader->getClassLibraryPath(types[i]);
+    classes.push_back(c);
+  }
+
+  ClassIndex index;
+  index.save(loader->getPluginXmlPaths(), classes);
+  ROS_DEBUG("Updated nodelet class index %s with %u classes", index.getPath().c_str(), (uint32_t)classes.size());
+}
+
+} // namespace detail
+} // namespace nodelet
@@ -6,6 +6,7 @@
 #include <boost/thread.hpp>
 #include <boost/detail/atomic_count.hpp>
 #include <cstdio>
+#include <cstdlib>
 
 using namespace nodelet::detail;
 using boost::detail::atomic_count;
@@ -32,8 +33,70 @@ public:
 };
 typedef boost::shared_ptr<MyCallback> MyCallbackPtr;
 
+class NoopCallback : public ros::CallbackInterface
+{
+public:
+  ros::CallbackInterface::CallResult call()
+  {
+    return Success;
+  }
+};
+
+template<typename Queue>
+void produce(Queue* queue, long count)
+{
+  ros::CallbackInterfacePtr cb(new NoopCallback);
+  for (long i = 0; i < count; ++i)
+  {
+    queue->addCallback(cb, 0);
+  }
+}
+
+// Pushes NUM_CALLBACKS through a bare queue from num_producers threads while one thread drains it,
+// to compare the queue itself without the CallbackQueueManager dispatch overhead.
+template<typename Queue>
+double timeQueue(Queue* queue, int num_producers)
+{
+  double start = ros::WallTime::now().toSec();
+
+  boost::thread_group producers;
+  for (int i = 0; i < num_producers; ++i)
+  {
+    producers.create_thread(boost::bind(&produce<Queue>, queue, NUM_CALLBACKS / num_producers));
+  }
+
+  long called = 0;
+  long expected = (NUM_CALLBACKS / num_producers) * num_producers;
+  while (called < expected)
+  {
+    if (queue->callOne() == ros::CallbackQueue::Called)
+    {
+      ++called;
+    }
+  }
+  producers.join_all();
+
+  return ros::WallTime::now().toSec() - start;
+}
+
 int main(int argc, char** argv)
 {
+  int num_producers = argc > 1 ? atoi(argv[1]) : 4;
+  if (num_producers < 1)
+  {
+    num_producers = 1;
+  }
+
+  {
+    ros::CallbackQueue queue;
+    printf("ros::CallbackQueue, %d producers: %.3f\n", num_producers, timeQueue(&queue, num_producers));
+  }
+
+  {
+    CallbackQueuePtr queue(new CallbackQueue(NULL));
+    printf("nodelet CallbackQueue, %d producers: %.3f\n", num_producers, timeQueue(queue.get(), num_producers));
+  }
+
   CallbackQueueManager man;
   CallbackQueuePtr queue(new CallbackQueue(&man));
   man.addQueue(queue, true);
@@ -48,7 +111,10 @@ int main(int argc, char** argv)
 
   {
     boost::mutex::scoped_lock lock(g_mutex);
-    g_cond.wait(lock);
+    while (g_count > 0)
+    {
+      g_cond.wait(lock);
+    }
   }
 
   double end = ros::WallTime::now().toSec();
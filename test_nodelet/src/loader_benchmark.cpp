@@ -0,0 +1,50 @@
+#include <nodelet/loader.h>
+#include <ros/time.h>
+
+#include <boost/shared_ptr.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <unistd.h>
+
+// Resident set size of this process in kB, or 0 if it can't be read
+static long residentKB()
+{
+  long pages = 0;
+  long resident = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f)
+  {
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+    {
+      resident = 0;
+    }
+    fclose(f);
+  }
+
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Constructs several Loaders in one process. The first one builds the pluginlib class loader and
+// parses the plugin descriptions; the others share it, so they should start in a fraction of the
+// time and add little memory.
+int main(int argc, char** argv)
+{
+  int num_loaders = argc > 1 ? atoi(argv[1]) : 8;
+  std::vector<boost::shared_ptr<nodelet::Loader> > loaders;
+  long start_kb = residentKB();
+  double total = 0.0;
+
+  for (int i = 0; i < num_loaders; ++i)
+  {
+    long before_kb = residentKB();
+    double start = ros::WallTime::now().toSec();
+    loaders.push_back(boost::shared_ptr<nodelet::Loader>(new nodelet::Loader(false)));
+    double elapsed = ros::WallTime::now().toSec() - start;
+    total += elapsed;
+    printf("Loader %d: %.3f ms, +%ld kB\n", i, elapsed * 1e3, residentKB() - before_kb);
+  }
+
+  printf("%d loaders: %.3f ms, +%ld kB total\n", num_loaders, total * 1e3, residentKB() - start_kb);
+  return 0;
+}
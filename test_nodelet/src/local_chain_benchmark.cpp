@@ -0,0 +1,127 @@
+#include <nodelet/loader.h>
+#include <nodelet/local_channel.h>
+#include <ros/ros.h>
+#include <ros/callback_queue.h>
+#include <std_msgs/Float64.h>
+#include <XmlRpcValue.h>
+
+#include <boost/lexical_cast.hpp>
+#include <cstdio>
+#include <cstdlib>
+
+static const int NUM_STAGES = 5;
+
+static double g_last = -1.0;
+
+static void outputCallback(const std_msgs::Float64::ConstPtr& msg)
+{
+  g_last = msg->data;
+}
+
+// Waits for the chain's output to the input value, spinning the driver's queue
+static bool waitForOutput(ros::CallbackQueue& queue, double expected, double timeout)
+{
+  ros::WallTime deadline = ros::WallTime::now() + ros::WallDuration(timeout);
+  while (g_last != expected)
+  {
+    if (ros::WallTime::now() > deadline || !ros::ok())
+    {
+      return false;
+    }
+    queue.callAvailable(ros::WallDuration(0.01));
+  }
+  return true;
+}
+
+// Loads NUM_STAGES test_nodelet/Plus, or LocalPlus, nodelets, each subscribed to the previous one's
+// output, and times single messages going through all of them.  Returns the mean time per message in seconds.
+static double timeChain(const std::string& prefix, bool local, int num_messages)
+{
+  nodelet::Loader loader(false);
+  for (int i = 0; i < NUM_STAGES; ++i)
+  {
+    std::string stage = prefix + "/stage" + boost::lexical_cast<std::string>(i);
+    nodelet::Loader::LoadRequest request;
+    request.name = stage;
+    request.type = local ? "test_nodelet/LocalPlus" : "test_nodelet/Plus";
+    if (i > 0)
+    {
+      request.remappings[stage + "/in"] = prefix + "/stage" + boost::lexical_cast<std::string>(i - 1) + "/out";
+    }
+    request.params.reset(new XmlRpc::XmlRpcValue);
+    (*request.params)["value"] = 1.0;
+    if (!loader.load(request))
+    {
+      fprintf(stderr, "Failed to load %s\n", stage.c_str());
+      exit(1);
+    }
+  }
+
+  ros::CallbackQueue queue;
+  ros::NodeHandle nh;
+  nh.setCallbackQueue(&queue);
+  std::string in_topic = prefix + "/stage0/in";
+  std::string out_topic = prefix + "/stage" + boost::lexical_cast<std::string>(NUM_STAGES - 1) + "/out";
+
+  ros::Publisher pub;
+  ros::Subscriber sub;
+  nodelet::LocalPublisher<std_msgs::Float64> local_pub;
+  nodelet::LocalSubscriber local_sub;
+  if (local)
+  {
+    local_pub = nodelet::LocalPublisher<std_msgs::Float64>(nh, in_topic, 10);
+    local_sub = nodelet::LocalSubscriber(nh, out_topic, 10,
+        boost::function<void (const std_msgs::Float64::ConstPtr&)>(&outputCallback));
+  }
+  else
+  {
+    pub = nh.advertise<std_msgs::Float64>(in_topic, 10);
+    sub = nh.subscribe(out_topic, 10, &outputCallback);
+  }
+
+  // Publish until the first message makes it through, so that all the ROS connections are up
+  bool connected = false;
+  for (int i = 0; i < 100 && !connected; ++i)
+  {
+    std_msgs::Float64Ptr msg(new std_msgs::Float64);
+    msg->data = -100.0;
+    local ? local_pub.publish(msg) : pub.publish(msg);
+    connected = waitForOutput(queue, -100.0 + NUM_STAGES, 0.1);
+  }
+  if (!connected)
+  {
+    fprintf(stderr, "%s never produced any output\n", prefix.c_str());
+    exit(1);
+  }
+
+  ros::WallTime start = ros::WallTime::now();
+  for (int i = 0; i < num_messages; ++i)
+  {
+    std_msgs::Float64Ptr msg(new std_msgs::Float64);
+    msg->data = i;
+    local ? local_pub.publish(msg) : pub.publish(msg);
+    if (!waitForOutput(queue, i + NUM_STAGES, 1.0))
+    {
+      fprintf(stderr, "%s lost message %d\n", prefix.c_str(), i);
+      exit(1);
+    }
+  }
+
+  return (ros::WallTime::now() - start).toSec() / num_messages;
+}
+
+// Not a real test.  Compares a chain of nodelets connected by ROS topics within one manager with
+// the same chain connected by local channels.  Needs a running master.
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "local_chain_benchmark");
+  int num_messages = argc > 1 ? atoi(argv[1]) : 10000;
+
+  double ros_time = timeChain("/chain_ros", false, num_messages);
+  printf("%d stages over ROS topics:     %.1f us per message\n", NUM_STAGES, ros_time * 1e6);
+
+  double local_time = timeChain("/chain_local", true, num_messages);
+  printf("%d stages over local channels: %.1f us per message\n", NUM_STAGES, local_time * 1e6);
+
+  return 0;
+}
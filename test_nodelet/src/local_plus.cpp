@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2009, Willow Garage, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pluginlib/class_list_macros.h>
+#include <nodelet/nodelet.h>
+#include <nodelet/local_channel.h>
+#include <nodelet/message_pool.h>
+#include <ros/ros.h>
+#include <std_msgs/Float64.h>
+
+namespace test_nodelet
+{
+
+// Plus on the in-process APIs: parameters from the load request, local channels and a message pool
+class LocalPlus : public nodelet::Nodelet
+{
+public:
+  LocalPlus()
+  : value_(0)
+  {}
+
+private:
+  virtual void onInit()
+  {
+    ros::NodeHandle& private_nh = getPrivateNodeHandle();
+    getLocalParam("value", value_);
+    pool_ = getMessagePool<std_msgs::Float64>();
+    pub = advertiseLocal<std_msgs::Float64>(private_nh, "out", 10);
+    sub = subscribeLocal(private_nh, "in", 10, &LocalPlus::callback, this);
+  }
+
+  void callback(const std_msgs::Float64::ConstPtr& input)
+  {
+    std_msgs::Float64Ptr output = pool_->allocate();
+    output->data = input->data + value_;
+    NODELET_DEBUG("Adding %f to get %f", value_, output->data);
+    pub.publish(output);
+  }
+
+  nodelet::LocalPublisher<std_msgs::Float64> pub;
+  nodelet::LocalSubscriber sub;
+  nodelet::MessagePool<std_msgs::Float64>::Ptr pool_;
+  double value_;
+};
+
+PLUGINLIB_DECLARE_CLASS(test_nodelet, LocalPlus, test_nodelet::LocalPlus, nodelet::Nodelet);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2014, Open Source Robotics Foundation, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Open Source Robotics Foundation, Inc. nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pluginlib/class_list_macros.h>
+#include <nodelet/nodelet.h>
+#include <ros/ros.h>
+
+namespace test_nodelet
+{
+
+class SlowNodelet : public nodelet::Nodelet
+{
+public:
+  SlowNodelet()
+  : callback_delay_(0)
+  {}
+
+private:
+  virtual void onInit()
+  {
+    double delay;
+    getPrivateNodeHandle().param("init_delay", delay, 5.0);
+    NODELET_INFO("Taking %.1f seconds to initialize", delay);
+    ros::WallDuration(delay).sleep();
+
+    // Optionally block the callback queue right after starting, e.g. to be unloaded meanwhile
+    getPrivateNodeHandle().param("callback_delay", callback_delay_, 0.0);
+    if (callback_delay_ > 0)
+    {
+      timer_ = getNodeHandle().createWallTimer(ros::WallDuration(0.1), &SlowNodelet::block, this, true);
+    }
+  }
+
+  void block(const ros::WallTimerEvent&)
+  {
+    NODELET_INFO("Taking %.1f seconds in a callback", callback_delay_);
+    ros::WallDuration(callback_delay_).sleep();
+  }
+
+  double callback_delay_;
+  ros::WallTimer timer_;
+};
+
+PLUGINLIB_DECLARE_CLASS(test_nodelet, SlowNodelet, test_nodelet::SlowNodelet, nodelet::Nodelet);
+}
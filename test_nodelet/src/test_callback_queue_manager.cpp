@@ -33,8 +33,13 @@
 #include <ros/time.h>
 #include <ros/console.h>
 
+#include <boost/atomic.hpp>
 #include <boost/thread.hpp>
 
+#include <stdexcept>
+
+#include <time.h>
+
 #include <gtest/gtest.h>
 
 using namespace nodelet;
@@ -184,6 +189,441 @@ TEST(CallbackQueueManager, multiThreaded)
   }
 }
 
+class BlockingCallback : public ros::CallbackInterface
+{
+public:
+  BlockingCallback()
+  : started(false)
+  , released(false)
+  {}
+
+  ros::CallbackInterface::CallResult call()
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    started = true;
+    cond.notify_all();
+    while (!released)
+    {
+      cond.wait(lock);
+    }
+
+    return Success;
+  }
+
+  void waitUntilStarted()
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    while (!started)
+    {
+      cond.wait(lock);
+    }
+  }
+
+  void release()
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    released = true;
+    cond.notify_all();
+  }
+
+  bool started;
+  bool released;
+  boost::mutex mutex;
+  boost::condition_variable cond;
+};
+typedef boost::shared_ptr<BlockingCallback> BlockingCallbackPtr;
+
+class RecordingCallback : public ros::CallbackInterface
+{
+public:
+  RecordingCallback(std::vector<int>* record, boost::mutex* mutex, int value)
+  : record_(record)
+  , mutex_(mutex)
+  , value_(value)
+  {}
+
+  ros::CallbackInterface::CallResult call()
+  {
+    boost::mutex::scoped_lock lock(*mutex_);
+    record_->push_back(value_);
+    return Success;
+  }
+
+private:
+  std::vector<int>* record_;
+  boost::mutex* mutex_;
+  int value_;
+};
+
+// Occupies the queue's worker with a blocking callback, adds (owner id, value) pairs while it is
+// held and returns the values that were eventually called, in order.
+std::vector<int> runBounded(CallbackQueue::OverflowPolicy policy, uint32_t max_size,
+                            const std::vector<std::pair<uint64_t, int> >& adds, uint64_t* dropped)
+{
+  CallbackQueueManager man(1);
+  CallbackQueuePtr queue(new CallbackQueue(&man));
+  man.addQueue(queue, false);
+  queue->setMaxSize(max_size, policy);
+
+  BlockingCallbackPtr blocker(new BlockingCallback);
+  queue->addCallback(blocker, 0);
+  blocker->waitUntilStarted();
+
+  std::vector<int> record;
+  boost::mutex record_mutex;
+  for (size_t i = 0; i < adds.size(); ++i)
+  {
+    ros::CallbackInterfacePtr cb(new RecordingCallback(&record, &record_mutex, adds[i].second));
+    queue->addCallback(cb, adds[i].first);
+  }
+  EXPECT_LE(queue->size(), max_size);
+  *dropped = queue->getDroppedCount();
+
+  blocker->release();
+  while (queue->size() > 0)
+  {
+    ros::WallDuration(0.01).sleep();
+  }
+  ros::WallDuration(0.05).sleep();
+
+  boost::mutex::scoped_lock lock(record_mutex);
+  return record;
+}
+
+TEST(CallbackQueue, overflowPolicies)
+{
+  std::vector<std::pair<uint64_t, int> > adds;
+  for (int i = 1; i <= 5; ++i)
+  {
+    adds.push_back(std::make_pair(1, i));
+  }
+
+  uint64_t dropped = 0;
+  std::vector<int> called = runBounded(CallbackQueue::DropOldest, 3, adds, &dropped);
+  ASSERT_EQ(called.size(), 3U);
+  EXPECT_EQ(called[0], 3);
+  EXPECT_EQ(called[2], 5);
+  EXPECT_EQ(dropped, 2U);
+
+  called = runBounded(CallbackQueue::DropNewest, 3, adds, &dropped);
+  ASSERT_EQ(called.size(), 3U);
+  EXPECT_EQ(called[0], 1);
+  EXPECT_EQ(called[2], 3);
+  EXPECT_EQ(dropped, 2U);
+
+  // Coalesce replaces the pending callback of the same owner and drops unrelated overflow
+  adds.clear();
+  adds.push_back(std::make_pair(1, 1));
+  adds.push_back(std::make_pair(2, 2));
+  adds.push_back(std::make_pair(1, 3));
+  adds.push_back(std::make_pair(3, 4));
+  called = runBounded(CallbackQueue::Coalesce, 2, adds, &dropped);
+  ASSERT_EQ(called.size(), 2U);
+  EXPECT_EQ(called[0], 2);
+  EXPECT_EQ(called[1], 3);
+  EXPECT_EQ(dropped, 2U);
+}
+
+TEST(CallbackQueue, blockingOverflow)
+{
+  CallbackQueueManager man(1);
+  CallbackQueuePtr queue(new CallbackQueue(&man));
+  man.addQueue(queue, false);
+  queue->setMaxSize(2, CallbackQueue::Block);
+
+  BlockingCallbackPtr blocker(new BlockingCallback);
+  queue->addCallback(blocker, 0);
+  blocker->waitUntilStarted();
+
+  std::vector<int> record;
+  boost::mutex record_mutex;
+  for (int i = 0; i < 2; ++i)
+  {
+    queue->addCallback(ros::CallbackInterfacePtr(new RecordingCallback(&record, &record_mutex, i)), 0);
+  }
+
+  // The third add has to wait until the worker makes room
+  ros::CallbackInterfacePtr third(new RecordingCallback(&record, &record_mutex, 2));
+  boost::thread producer(boost::bind(&CallbackQueue::addCallback, queue.get(), third, 0));
+  EXPECT_FALSE(producer.timed_join(boost::posix_time::milliseconds(100)));
+
+  blocker->release();
+  EXPECT_TRUE(producer.timed_join(boost::posix_time::seconds(5)));
+  while (queue->size() > 0)
+  {
+    ros::WallDuration(0.01).sleep();
+  }
+  ros::WallDuration(0.05).sleep();
+
+  boost::mutex::scoped_lock lock(record_mutex);
+  EXPECT_EQ(record.size(), 3U);
+  EXPECT_EQ(queue->getDroppedCount(), 0U);
+}
+
+void removeQueueThread(CallbackQueueManager* man, CallbackQueuePtr queue, boost::atomic<bool>* done)
+{
+  man->removeQueue(queue);
+  *done = true;
+}
+
+TEST(CallbackQueueManager, removeQueueWaitsForCallback)
+{
+  CallbackQueueManager man(2);
+  CallbackQueuePtr queue(new CallbackQueue(&man));
+  man.addQueue(queue, false);
+
+  BlockingCallbackPtr cb(new BlockingCallback);
+  queue->addCallback(cb, 0);
+  cb->waitUntilStarted();
+
+  BlockingCallbackPtr pending(new BlockingCallback);
+  pending->release();
+  queue->addCallback(pending, 0);
+
+  boost::atomic<bool> done(false);
+  boost::thread remover(boost::bind(removeQueueThread, &man, queue, &done));
+  ros::WallDuration(0.1).sleep();
+  EXPECT_FALSE(done);
+
+  cb->release();
+  remover.join();
+  EXPECT_TRUE(done);
+
+  // Once removed the queue neither calls what it holds nor accepts anything new
+  ros::WallDuration(0.05).sleep();
+  EXPECT_FALSE(pending->started);
+  EXPECT_FALSE(queue->isEnabled());
+  queue->addCallback(pending, 0);
+  EXPECT_EQ(queue->callOne(), ros::CallbackQueue::Disabled);
+  EXPECT_FALSE(pending->started);
+}
+
+TEST(CallbackQueueManager, removeQueueIgnoresOtherQueues)
+{
+  CallbackQueueManager man(2);
+  CallbackQueuePtr busy(new CallbackQueue(&man));
+  man.addQueue(busy, false);
+  CallbackQueuePtr idle(new CallbackQueue(&man));
+  man.addQueue(idle, false);
+
+  BlockingCallbackPtr cb(new BlockingCallback);
+  busy->addCallback(cb, 0);
+  cb->waitUntilStarted();
+
+  // A long callback on another queue must not hold up the removal
+  boost::atomic<bool> done(false);
+  boost::thread remover(boost::bind(removeQueueThread, &man, idle, &done));
+  EXPECT_TRUE(remover.timed_join(boost::posix_time::seconds(1)));
+  EXPECT_TRUE(done);
+
+  cb->release();
+  man.removeQueue(busy);
+}
+
+TEST(CallbackQueueManager, pausedQueue)
+{
+  CallbackQueueManager man(2);
+  CallbackQueuePtr queue(new CallbackQueue(&man));
+  man.addQueue(queue, false, true);
+
+  std::vector<int> record;
+  boost::mutex record_mutex;
+  queue->addCallback(ros::CallbackInterfacePtr(new RecordingCallback(&record, &record_mutex, 1)), 0);
+  ros::WallDuration(0.01).sleep();
+  ros::WallTime handover = ros::WallTime::now();
+  queue->addCallback(ros::CallbackInterfacePtr(new RecordingCallback(&record, &record_mutex, 2)), 0);
+  queue->addCallback(ros::CallbackInterfacePtr(new RecordingCallback(&record, &record_mutex, 3)), 0);
+  ros::WallDuration(0.1).sleep();
+  EXPECT_EQ(queue->size(), 3U);
+
+  // What came in before the handover is dropped, the rest is called once resumed
+  queue->discardAddedBefore(handover);
+  man.resumeQueue(queue);
+  for (int i = 0; i < 100 && queue->size() > 0; ++i)
+  {
+    ros::WallDuration(0.01).sleep();
+  }
+  ros::WallDuration(0.05).sleep();
+
+  {
+    boost::mutex::scoped_lock lock(record_mutex);
+    ASSERT_EQ(record.size(), 2U);
+    EXPECT_EQ(record[0], 2);
+    EXPECT_EQ(record[1], 3);
+  }
+  man.removeQueue(queue);
+}
+
+TEST(CallbackQueue, removeByIDLargeQueue)
+{
+  const uint32_t count = 100000;
+  CallbackQueuePtr queue(new CallbackQueue(NULL));
+  queue->setMaxSize(count + 10, CallbackQueue::DropNewest);
+
+  std::vector<int> record;
+  boost::mutex record_mutex;
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    queue->addCallback(ros::CallbackInterfacePtr(new RecordingCallback(&record, &record_mutex, 0)), 1);
+    if (i % (count / 10) == 0)
+    {
+      queue->addCallback(ros::CallbackInterfacePtr(new RecordingCallback(&record, &record_mutex, 2)), 2);
+    }
+  }
+  EXPECT_EQ(queue->size(), count + 10);
+
+  queue->removeByID(1);
+  EXPECT_EQ(queue->size(), 10U);
+
+  // The space held by the removed callbacks is available again right away
+  for (uint32_t i = 0; i < 10; ++i)
+  {
+    queue->addCallback(ros::CallbackInterfacePtr(new RecordingCallback(&record, &record_mutex, 3)), 3);
+  }
+  EXPECT_EQ(queue->size(), 20U);
+  EXPECT_EQ(queue->getDroppedCount(), 0U);
+
+  // Adding under a removed id starts over
+  queue->addCallback(ros::CallbackInterfacePtr(new RecordingCallback(&record, &record_mutex, 1)), 1);
+
+  while (queue->callOne() == ros::CallbackQueue::Called)
+  {
+  }
+
+  ASSERT_EQ(record.size(), 21U);
+  for (size_t i = 0; i < 10; ++i)
+  {
+    EXPECT_EQ(record[i], 2);
+    EXPECT_EQ(record[i + 10], 3);
+  }
+  EXPECT_EQ(record[20], 1);
+  EXPECT_EQ(queue->size(), 0U);
+}
+
+TEST(CallbackQueue, dropOldestAfterRemoveByID)
+{
+  CallbackQueuePtr queue(new CallbackQueue(NULL));
+  queue->setMaxSize(3, CallbackQueue::DropOldest);
+
+  std::vector<int> record;
+  boost::mutex record_mutex;
+  for (int i = 0; i < 3; ++i)
+  {
+    queue->addCallback(ros::CallbackInterfacePtr(new RecordingCallback(&record, &record_mutex, 1)), 1);
+  }
+  queue->removeByID(1);
+  EXPECT_EQ(queue->size(), 0U);
+
+  // The removed callbacks are still linked, but evicting them must not make room
+  for (int i = 0; i < 5; ++i)
+  {
+    queue->addCallback(ros::CallbackInterfacePtr(new RecordingCallback(&record, &record_mutex, 2 + i)), 2);
+    EXPECT_LE(queue->size(), 3U);
+  }
+  EXPECT_EQ(queue->getDroppedCount(), 2U);
+
+  while (queue->callOne() == ros::CallbackQueue::Called)
+  {
+  }
+
+  ASSERT_EQ(record.size(), 3U);
+  EXPECT_EQ(record[0], 4);
+  EXPECT_EQ(record[2], 6);
+  EXPECT_EQ(queue->size(), 0U);
+}
+
+class ThrowingCallback : public ros::CallbackInterface
+{
+public:
+  ros::CallbackInterface::CallResult call()
+  {
+    throw std::runtime_error("callback failed");
+  }
+};
+
+TEST(CallbackQueue, throwingCallback)
+{
+  CallbackQueuePtr queue(new CallbackQueue(NULL));
+  queue->addCallback(ros::CallbackInterfacePtr(new ThrowingCallback), 1);
+  EXPECT_THROW(queue->callOne(), std::runtime_error);
+  EXPECT_EQ(CallbackQueue::getCurrentLatency(), ros::WallDuration());
+
+  // removeByID() would wait forever if the failed call were still counted as in progress
+  boost::thread remover(boost::bind(&CallbackQueue::removeByID, queue.get(), 1));
+  EXPECT_TRUE(remover.timed_join(boost::posix_time::seconds(5)));
+  EXPECT_EQ(queue->size(), 0U);
+}
+
+class LatencyCallback : public ros::CallbackInterface
+{
+public:
+  ros::CallbackInterface::CallResult call()
+  {
+    latency = CallbackQueue::getCurrentLatency();
+    return Success;
+  }
+
+  ros::WallDuration latency;
+};
+typedef boost::shared_ptr<LatencyCallback> LatencyCallbackPtr;
+
+TEST(CallbackQueue, latency)
+{
+  CallbackQueuePtr queue(new CallbackQueue(NULL));
+  LatencyCallbackPtr cb(new LatencyCallback);
+
+  queue->addCallback(cb, 0);
+  ros::WallDuration(0.05).sleep();
+  ASSERT_EQ(queue->callOne(), ros::CallbackQueue::Called);
+  EXPECT_GE(cb->latency.toSec(), 0.05);
+
+  queue->addCallback(cb, 0);
+  ASSERT_EQ(queue->callOne(), ros::CallbackQueue::Called);
+  EXPECT_LT(cb->latency.toSec(), 0.05);
+
+  CallbackQueue::LatencyStats stats = queue->getLatencyStats();
+  EXPECT_EQ(stats.count, 2U);
+  EXPECT_GE(stats.max.toSec(), 0.05);
+  EXPECT_GE(stats.total.toSec(), stats.max.toSec());
+
+  // Only meaningful inside a callback
+  EXPECT_TRUE(CallbackQueue::getCurrentLatency().isZero());
+}
+
+// Uses 50ms of CPU time on its thread
+class SpinningCallback : public ros::CallbackInterface
+{
+public:
+  ros::CallbackInterface::CallResult call()
+  {
+    double start = threadCPUTime();
+    while (threadCPUTime() - start < 0.05)
+    {
+    }
+    return Success;
+  }
+
+private:
+  static double threadCPUTime()
+  {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+  }
+};
+
+TEST(CallbackQueue, cpuTime)
+{
+  CallbackQueuePtr queue(new CallbackQueue(NULL));
+  queue->addCallback(LatencyCallbackPtr(new LatencyCallback), 0);
+  ASSERT_EQ(queue->callOne(), ros::CallbackQueue::Called);
+  EXPECT_LT(queue->getCPUTime().toSec(), 0.04);
+
+  queue->addCallback(ros::CallbackInterfacePtr(new SpinningCallback), 0);
+  ASSERT_EQ(queue->callOne(), ros::CallbackQueue::Called);
+  EXPECT_GE(queue->getCPUTime().toSec(), 0.05);
+}
+
 int main(int argc, char** argv)
 {
   ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2010, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <nodelet/detail/class_index.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <sys/stat.h>
+#include <utime.h>
+
+#include <gtest/gtest.h>
+
+using namespace nodelet::detail;
+
+// A package path with one nodelet package a level down, and an index of it.  Everything starts out
+// with an mtime in the past, so that any change made by a test shows up as a new mtime.
+class ClassIndexTest : public testing::Test
+{
+protected:
+  void SetUp()
+  {
+    char tmpl[] = "/tmp/test_class_index.XXXXXX";
+    ASSERT_TRUE(mkdtemp(tmpl) != NULL);
+    dir_ = tmpl;
+    root_ = dir_ + "/src";
+    package_ = root_ + "/group/pkg_a";
+    plugin_xml_ = package_ + "/nodelets.xml";
+
+    makeDir(root_);
+    makeDir(root_ + "/group");
+    makeDir(package_);
+    writeFile(package_ + "/package.xml", "<package><name>pkg_a</name></package>\n");
+    writeFile(plugin_xml_, "<library path=\"lib/libpkg_a\"/>\n");
+    backdate(package_ + "/package.xml");
+    backdate(plugin_xml_);
+    backdate(package_);
+    backdate(root_ + "/group");
+    backdate(root_);
+
+    old_package_path_ = getenv("ROS_PACKAGE_PATH") ? getenv("ROS_PACKAGE_PATH") : "";
+    setenv("ROS_PACKAGE_PATH", root_.c_str(), 1);
+
+    ClassIndex::Class c;
+    c.type = "pkg_a/Plus";
+    c.plugin_xml = plugin_xml_;
+    c.library = package_ + "/lib/libpkg_a.so";
+    classes_.push_back(c);
+    ClassIndex index(dir_ + "/nodelet_index");
+    index.save(std::vector<std::string>(1, plugin_xml_), classes_);
+  }
+
+  void TearDown()
+  {
+    setenv("ROS_PACKAGE_PATH", old_package_path_.c_str(), 1);
+    std::system(("rm -rf " + dir_).c_str());
+  }
+
+  static void makeDir(const std::string& path)
+  {
+    ASSERT_EQ(mkdir(path.c_str(), 0700), 0);
+  }
+
+  static void writeFile(const std::string& path, const std::string& contents)
+  {
+    std::ofstream file(path.c_str());
+    file << contents;
+  }
+
+  static void backdate(const std::string& path)
+  {
+    struct utimbuf times;
+    times.actime = times.modtime = 1000000000;
+    ASSERT_EQ(utime(path.c_str(), &times), 0);
+  }
+
+  std::string dir_;
+  std::string root_;
+  std::string package_;
+  std::string plugin_xml_;
+  std::string old_package_path_;
+  std::vector<ClassIndex::Class> classes_;
+};
+
+TEST_F(ClassIndexTest, hit)
+{
+  ClassIndex index(dir_ + "/nodelet_index");
+  ASSERT_TRUE(index.load());
+  ASSERT_EQ(index.getPluginXmlPaths().size(), 1U);
+  EXPECT_EQ(index.getPluginXmlPaths()[0], plugin_xml_);
+  ASSERT_EQ(index.getClasses().size(), 1U);
+  EXPECT_EQ(index.getClasses()[0].type, classes_[0].type);
+  EXPECT_EQ(index.getClasses()[0].plugin_xml, classes_[0].plugin_xml);
+  EXPECT_EQ(index.getClasses()[0].library, classes_[0].library);
+}
+
+TEST_F(ClassIndexTest, miss)
+{
+  ClassIndex index(dir_ + "/no_such_index");
+  EXPECT_FALSE(index.load());
+  EXPECT_TRUE(index.getClasses().empty());
+
+  // Nor is an index for another package path any use
+  setenv("ROS_PACKAGE_PATH", dir_.c_str(), 1);
+  ClassIndex other(dir_ + "/nodelet_index");
+  EXPECT_FALSE(other.load());
+}
+
+TEST_F(ClassIndexTest, staleManifest)
+{
+  writeFile(package_ + "/package.xml", "<package><name>pkg_a</name><export/></package>\n");
+  ClassIndex index(dir_ + "/nodelet_index");
+  EXPECT_FALSE(index.load());
+  EXPECT_TRUE(index.getPluginXmlPaths().empty());
+}
+
+TEST_F(ClassIndexTest, newPackage)
+{
+  // Neither the package path root nor any tracked file changes, only the directory holding it
+  makeDir(root_ + "/group/pkg_b");
+  writeFile(root_ + "/group/pkg_b/package.xml", "<package><name>pkg_b</name></package>\n");
+  ClassIndex index(dir_ + "/nodelet_index");
+  EXPECT_FALSE(index.load());
+}
+
+int main(int argc, char** argv)
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
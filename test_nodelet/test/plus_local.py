@@ -81,6 +81,10 @@ class TestPlus(unittest.TestCase):
         pb = PlusTester("Plus2/in", "Plus3/out", 12.5)
         self.assertTrue(pb.run())
 
+    def test_local_chain(self):
+        pb = PlusTester("LocalPlus1/in", "LocalPlus3/out", 3.0)
+        self.assertTrue(pb.run())
+
 if __name__ == '__main__':
     rospy.init_node('plus_local')
     rostest.unitrun('test_nodelet', 'test_plus', TestPlus)
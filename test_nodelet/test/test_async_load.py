@@ -0,0 +1,54 @@
+#!/usr/bin/env python
+
+import roslib; roslib.load_manifest('test_nodelet')
+import rospy
+import unittest
+import rostest
+import threading
+import time
+
+from nodelet.srv import *
+
+class TestAsyncLoad(unittest.TestCase):
+    def test_slow_load_does_not_block(self):
+        '''
+        Test that a nodelet with a slow onInit() doesn't hold up loading
+        another nodelet or listing the loaded ones.
+        '''
+        load = rospy.ServiceProxy('/nodelet_manager/load_nodelet', NodeletLoad)
+        list = rospy.ServiceProxy('/nodelet_manager/list', NodeletList)
+        load.wait_for_service()
+        list.wait_for_service()
+
+        slow_result = []
+        def load_slow():
+            req = NodeletLoadRequest()
+            req.name = '/slow_nodelet'
+            req.type = 'test_nodelet/SlowNodelet'
+            slow_result.append(load.call(req).success)
+
+        slow_thread = threading.Thread(target=load_slow)
+        slow_thread.start()
+        time.sleep(1.0)
+        self.assertTrue(slow_thread.is_alive())
+
+        start = time.time()
+        req = NodeletLoadRequest()
+        req.name = '/fast_nodelet'
+        req.type = 'test_nodelet/Plus'
+        self.assertTrue(load.call(req).success)
+        nodelets = list.call(NodeletListRequest()).nodelets
+        elapsed = time.time() - start
+
+        self.assertLess(elapsed, 3.0)
+        self.assertTrue(slow_thread.is_alive())
+        self.assertIn('/fast_nodelet', nodelets)
+        self.assertNotIn('/slow_nodelet', nodelets)
+
+        slow_thread.join()
+        self.assertEqual(slow_result, [True])
+        self.assertIn('/slow_nodelet', list.call(NodeletListRequest()).nodelets)
+
+if __name__ == '__main__':
+    rospy.init_node('test_async_load')
+    rostest.unitrun('test_nodelet', 'test_async_load', TestAsyncLoad)
@@ -0,0 +1,57 @@
+#!/usr/bin/env python
+
+import roslib; roslib.load_manifest('test_nodelet')
+import rospy
+import unittest
+import rostest
+import threading
+
+from nodelet.srv import *
+from std_msgs.msg import Float64
+
+class TestGraph(unittest.TestCase):
+    def test_graph_loaded(self):
+        '''
+        Test that a manager loads the nodelet graph from its ~graph parameter,
+        with the parameters and remappings of each nodelet.
+        '''
+        list = rospy.ServiceProxy('/nodelet_manager/list', NodeletList)
+        list.wait_for_service()
+        nodelets = list.call(NodeletListRequest()).nodelets
+        self.assertIn('/graph_plus_a', nodelets)
+        self.assertIn('/graph_plus_b', nodelets)
+
+        received = []
+        event = threading.Event()
+        def callback(msg):
+            received.append(msg.data)
+            event.set()
+
+        sub = rospy.Subscriber('/graph_plus_b/out', Float64, callback)
+        pub = rospy.Publisher('/graph_plus_a/in', Float64, queue_size=1)
+        for i in range(50):
+            pub.publish(Float64(0.5))
+            if event.wait(0.2):
+                break
+
+        self.assertTrue(received)
+        self.assertAlmostEqual(received[0], 3.5)
+
+    def test_list_info(self):
+        '''
+        Test that list_info reports the type and pool of the graph nodelets.
+        '''
+        list_info = rospy.ServiceProxy('/nodelet_manager/list_info', NodeletListInfo)
+        list_info.wait_for_service()
+        infos = dict((n.name, n) for n in list_info.call(NodeletListInfoRequest()).nodelets)
+        self.assertEqual(infos['/graph_plus_a'].type, 'test_nodelet/Plus')
+        self.assertEqual(infos['/graph_plus_a'].pool, '')
+        self.assertEqual(infos['/graph_plus_b'].pool, 'chain')
+        self.assertGreater(infos['/graph_plus_b'].load_stamp.to_sec(), 0)
+        for n in infos.values():
+            self.assertGreaterEqual(n.queue_latency_mean, 0)
+            self.assertGreaterEqual(n.queue_latency_max, n.queue_latency_mean)
+
+if __name__ == '__main__':
+    rospy.init_node('test_graph')
+    rostest.unitrun('test_nodelet', 'test_graph', TestGraph)
@@ -0,0 +1,47 @@
+#!/usr/bin/env python
+
+import roslib; roslib.load_manifest('test_nodelet')
+import rospy
+import unittest
+import rostest
+import threading
+import time
+
+from nodelet.srv import *
+from std_msgs.msg import Float64
+
+class TestLoadGroup(unittest.TestCase):
+    def test_load_group(self):
+        '''
+        Test that one load-group process loads several nodelets, each with
+        its own parameters and the process' remappings.
+        '''
+        list = rospy.ServiceProxy('/nodelet_manager/list', NodeletList)
+        list.wait_for_service()
+        for i in range(100):
+            nodelets = list.call(NodeletListRequest()).nodelets
+            if '/group_a' in nodelets and '/group_b' in nodelets:
+                break
+            time.sleep(0.1)
+        self.assertIn('/group_a', nodelets)
+        self.assertIn('/group_b', nodelets)
+
+        received = []
+        event = threading.Event()
+        def callback(msg):
+            received.append(msg.data)
+            event.set()
+
+        sub = rospy.Subscriber('/group_b/out', Float64, callback)
+        pub = rospy.Publisher('/group_a/in', Float64, queue_size=1)
+        for i in range(50):
+            pub.publish(Float64(0.5))
+            if event.wait(0.2):
+                break
+
+        self.assertTrue(received)
+        self.assertAlmostEqual(received[0], 3.5)
+
+if __name__ == '__main__':
+    rospy.init_node('test_load_group')
+    rostest.unitrun('test_nodelet', 'test_load_group', TestLoadGroup)
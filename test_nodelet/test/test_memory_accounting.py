@@ -0,0 +1,63 @@
+#!/usr/bin/env python
+
+import roslib; roslib.load_manifest('test_nodelet')
+import rospy
+import unittest
+import rostest
+import threading
+
+from nodelet.srv import NodeletListInfo, NodeletListInfoRequest, NodeletLoad, NodeletLoadRequest, NodeletUnload, NodeletUnloadRequest
+from std_msgs.msg import Float64
+
+class TestMemoryAccounting(unittest.TestCase):
+    def test_memory_accounting(self):
+        '''
+        Test that a manager started with NODELET_MEMORY_ACCOUNTING charges the
+        memory a nodelet allocates in onInit() and its callbacks to it.
+        '''
+        event = threading.Event()
+        sub = rospy.Subscriber('/accounted_plus/out', Float64, lambda msg: event.set())
+        pub = rospy.Publisher('/accounted_plus/in', Float64, queue_size=1)
+        for i in range(50):
+            pub.publish(Float64(0.5))
+            if event.wait(0.2):
+                break
+        self.assertTrue(event.is_set())
+
+        list_info = rospy.ServiceProxy('/nodelet_manager/list_info', NodeletListInfo)
+        list_info.wait_for_service()
+        infos = dict((n.name, n) for n in list_info.call(NodeletListInfoRequest()).nodelets)
+        info = infos['/accounted_plus']
+        self.assertGreater(info.memory_allocations, 0)
+        self.assertGreater(info.memory_live_bytes, 0)
+        self.assertGreaterEqual(info.memory_allocated_bytes, info.memory_live_bytes)
+
+    def test_load_unload_cycles(self):
+        '''
+        Test that accounts are freed and replaced safely when nodelets come and go,
+        with memory charged to earlier instances freed after their unload.
+        '''
+        load = rospy.ServiceProxy('/nodelet_manager/load_nodelet', NodeletLoad)
+        unload = rospy.ServiceProxy('/nodelet_manager/unload_nodelet', NodeletUnload)
+        list_info = rospy.ServiceProxy('/nodelet_manager/list_info', NodeletListInfo)
+        load.wait_for_service()
+        unload.wait_for_service()
+        list_info.wait_for_service()
+
+        req = NodeletLoadRequest()
+        req.name = '/cycled_plus'
+        req.type = 'test_nodelet/Plus'
+        for i in range(10):
+            res = load.call(req)
+            self.assertTrue(res.success)
+            infos = dict((n.name, n) for n in list_info.call(NodeletListInfoRequest()).nodelets)
+            self.assertGreater(infos['/cycled_plus'].memory_allocations, 0)
+            res = unload.call(NodeletUnloadRequest(name='/cycled_plus'))
+            self.assertTrue(res.success)
+
+        infos = dict((n.name, n) for n in list_info.call(NodeletListInfoRequest()).nodelets)
+        self.assertFalse('/cycled_plus' in infos)
+
+if __name__ == '__main__':
+    rospy.init_node('test_memory_accounting')
+    rostest.unitrun('test_nodelet', 'test_memory_accounting', TestMemoryAccounting)
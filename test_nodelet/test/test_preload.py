@@ -0,0 +1,48 @@
+#!/usr/bin/env python
+
+import roslib; roslib.load_manifest('test_nodelet')
+import rospy
+import rosnode
+import unittest
+import rostest
+import time
+
+try:
+    from xmlrpc.client import ServerProxy
+except ImportError:
+    from xmlrpclib import ServerProxy
+
+from nodelet.srv import *
+
+class TestPreload(unittest.TestCase):
+    def test_library_loaded_before_first_load(self):
+        '''
+        Test that the manager loads the libraries listed in ~preload on its
+        own, before any nodelet from them is loaded.
+        '''
+        list = rospy.ServiceProxy('/nodelet_manager/list', NodeletList)
+        list.wait_for_service()
+
+        uri = rosnode.get_api_uri(rospy.get_master(), '/nodelet_manager')
+        code, msg, pid = ServerProxy(uri).getPid('/test_preload')
+        self.assertEqual(code, 1)
+
+        def library_mapped():
+            with open('/proc/%d/maps' % pid) as maps:
+                return 'libtest_nodelet.so' in maps.read()
+
+        timeout_t = time.time() + 10.0
+        while not library_mapped() and time.time() < timeout_t:
+            time.sleep(0.1)
+        self.assertTrue(library_mapped())
+        self.assertEqual(list.call(NodeletListRequest()).nodelets, [])
+
+        load = rospy.ServiceProxy('/nodelet_manager/load_nodelet', NodeletLoad)
+        req = NodeletLoadRequest()
+        req.name = '/plus'
+        req.type = 'test_nodelet/Plus'
+        self.assertTrue(load.call(req).success)
+
+if __name__ == '__main__':
+    rospy.init_node('test_preload')
+    rostest.unitrun('test_nodelet', 'test_preload', TestPreload)
@@ -0,0 +1,102 @@
+#!/usr/bin/env python
+
+import roslib; roslib.load_manifest('test_nodelet')
+import rospy
+import unittest
+import rostest
+import threading
+import time
+
+from nodelet.srv import *
+from std_msgs.msg import Float64
+
+class TestReload(unittest.TestCase):
+    def expect_output(self, pub, value, expected):
+        # Outputs of earlier inputs may still be on their way
+        for i in range(50):
+            self.event.clear()
+            pub.publish(Float64(value))
+            if self.event.wait(0.2) and abs(self.received[-1] - expected) < 1e-6:
+                return
+        self.fail('No output of %f from the nodelet, got %s' % (expected, self.received[-5:]))
+
+    def test_reload(self):
+        '''
+        Test that reloading a nodelet picks up its new parameters, while
+        the existing subscription to its output keeps working.
+        '''
+        load = rospy.ServiceProxy('/nodelet_manager/load_nodelet', NodeletLoad)
+        reload = rospy.ServiceProxy('/nodelet_manager/reload_nodelet', NodeletReload)
+        load.wait_for_service()
+        reload.wait_for_service()
+
+        req = NodeletLoadRequest()
+        req.name = '/reload_plus'
+        req.type = 'test_nodelet/Plus'
+        self.assertTrue(load.call(req).success)
+
+        self.received = []
+        self.event = threading.Event()
+        def callback(msg):
+            self.received.append(msg.data)
+            self.event.set()
+
+        sub = rospy.Subscriber('/reload_plus/out', Float64, callback)
+        pub = rospy.Publisher('/reload_plus/in', Float64, queue_size=1)
+        self.expect_output(pub, 0.5, 1.5)
+
+        rospy.set_param('/reload_plus/value', 5.0)
+        self.assertTrue(reload.call(NodeletReloadRequest(name='/reload_plus')).success)
+        self.expect_output(pub, 0.5, 5.5)
+
+        self.assertFalse(reload.call(NodeletReloadRequest(name='/not_loaded')).success)
+
+    def test_no_duplicates(self):
+        '''
+        Test that the old and new instances don't both handle the messages
+        that arrive while a nodelet is being reloaded.
+        '''
+        load = rospy.ServiceProxy('/nodelet_manager/load_nodelet', NodeletLoad)
+        reload = rospy.ServiceProxy('/nodelet_manager/reload_nodelet', NodeletReload)
+        load.wait_for_service()
+        reload.wait_for_service()
+
+        req = NodeletLoadRequest()
+        req.name = '/reload_stream'
+        req.type = 'test_nodelet/Plus'
+        self.assertTrue(load.call(req).success)
+
+        outputs = []
+        sub = rospy.Subscriber('/reload_stream/out', Float64, lambda msg: outputs.append(msg.data))
+        pub = rospy.Publisher('/reload_stream/in', Float64, queue_size=100)
+        timeout_t = time.time() + 10.0
+        while not outputs and time.time() < timeout_t:
+            pub.publish(Float64(-1.0))
+            time.sleep(0.1)
+        self.assertTrue(outputs)
+
+        # Every input is distinct, and so is its output from either instance
+        stop = threading.Event()
+        def stream():
+            value = 0.0
+            while not stop.is_set():
+                pub.publish(Float64(value))
+                value += 1.0
+                time.sleep(0.005)
+        streamer = threading.Thread(target=stream)
+        streamer.start()
+        time.sleep(1.0)
+        self.assertTrue(reload.call(NodeletReloadRequest(name='/reload_stream')).success)
+        reloaded = len(outputs)
+        time.sleep(1.0)
+        stop.set()
+        streamer.join()
+        time.sleep(1.0)
+
+        self.assertGreater(len(outputs), reloaded)
+        streamed = [v for v in outputs if v >= 1.0]
+        self.assertEqual(len(streamed), len(set(streamed)))
+
+if __name__ == '__main__':
+    rospy.init_node('test_reload')
+    rostest.unitrun('test_nodelet', 'test_reload', TestReload)
@@ -0,0 +1,53 @@
+#!/usr/bin/env python
+
+import roslib; roslib.load_manifest('test_nodelet')
+import rospy
+import unittest
+import rostest
+import time
+
+from bondpy import bondpy
+from nodelet.msg import NodeletLoadEntry
+from nodelet.srv import *
+
+class TestSharedBond(unittest.TestCase):
+    def test_shared_bond(self):
+        '''
+        Test that nodelets loaded with the same bond id share one bond,
+        which outlives the unload of one of them and unloads the rest
+        when it breaks.
+        '''
+        load_batch = rospy.ServiceProxy('/nodelet_manager/load_nodelet_batch', NodeletLoadBatch)
+        unload = rospy.ServiceProxy('/nodelet_manager/unload_nodelet', NodeletUnload)
+        list = rospy.ServiceProxy('/nodelet_manager/list', NodeletList)
+        load_batch.wait_for_service()
+
+        bond_id = 'test_shared_bond'
+        req = NodeletLoadBatchRequest()
+        for name in ['/shared_a', '/shared_b', '/shared_c']:
+            req.nodelets.append(NodeletLoadEntry(name=name, type='test_nodelet/Plus', bond_id=bond_id))
+        self.assertEqual(load_batch.call(req).success, [True, True, True])
+
+        bond = bondpy.Bond('/nodelet_manager/bond', bond_id)
+        bond.start()
+        self.assertTrue(bond.wait_until_formed(rospy.Duration(5.0)))
+
+        self.assertTrue(unload.call(NodeletUnloadRequest(name='/shared_a')).success)
+        self.assertFalse(bond.wait_until_broken(rospy.Duration(1.0)))
+        nodelets = list.call(NodeletListRequest()).nodelets
+        self.assertNotIn('/shared_a', nodelets)
+        self.assertIn('/shared_b', nodelets)
+        self.assertIn('/shared_c', nodelets)
+
+        bond.break_bond()
+        for i in range(50):
+            nodelets = list.call(NodeletListRequest()).nodelets
+            if '/shared_b' not in nodelets and '/shared_c' not in nodelets:
+                break
+            time.sleep(0.1)
+        self.assertNotIn('/shared_b', nodelets)
+        self.assertNotIn('/shared_c', nodelets)
+
+if __name__ == '__main__':
+    rospy.init_node('test_shared_bond')
+    rostest.unitrun('test_nodelet', 'test_shared_bond', TestSharedBond)
@@ -0,0 +1,35 @@
+#!/usr/bin/env python
+
+import roslib; roslib.load_manifest('test_nodelet')
+import rospy
+import unittest
+import rostest
+import threading
+
+from std_msgs.msg import Float64
+
+class TestStandaloneGroup(unittest.TestCase):
+    def test_standalone_group(self):
+        '''
+        Test that a standalone node runs the extra nodelets given with --with,
+        chained through the node's remappings.
+        '''
+        received = []
+        event = threading.Event()
+        def callback(msg):
+            received.append(msg.data)
+            event.set()
+
+        sub = rospy.Subscriber('/standalone_b/out', Float64, callback)
+        pub = rospy.Publisher('/standalone_a/in', Float64, queue_size=1)
+        for i in range(100):
+            pub.publish(Float64(0.5))
+            if event.wait(0.2):
+                break
+
+        self.assertTrue(received)
+        self.assertAlmostEqual(received[0], 3.5)
+
+if __name__ == '__main__':
+    rospy.init_node('test_standalone_group')
+    rostest.unitrun('test_nodelet', 'test_standalone_group', TestStandaloneGroup)
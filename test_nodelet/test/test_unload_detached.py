@@ -0,0 +1,68 @@
+#!/usr/bin/env python
+
+import roslib; roslib.load_manifest('test_nodelet')
+import rospy
+import unittest
+import rostest
+import time
+
+from nodelet.srv import *
+
+class TestUnloadDetached(unittest.TestCase):
+    def test_unload_busy_nodelet(self):
+        '''
+        Test that unloading a nodelet stuck in a callback returns after the
+        drain timeout, and that its name stays taken until it is destroyed.
+        '''
+        load = rospy.ServiceProxy('/nodelet_manager/load_nodelet', NodeletLoad)
+        unload = rospy.ServiceProxy('/nodelet_manager/unload_nodelet_detached', NodeletUnload)
+        list = rospy.ServiceProxy('/nodelet_manager/list', NodeletList)
+        load.wait_for_service()
+        unload.wait_for_service()
+        list.wait_for_service()
+
+        req = NodeletLoadRequest()
+        req.name = '/slow_unload'
+        req.type = 'test_nodelet/SlowNodelet'
+        self.assertTrue(load.call(req).success)
+        # Let the nodelet get into its 5 second callback
+        time.sleep(1.0)
+
+        start = time.time()
+        self.assertTrue(unload.call(NodeletUnloadRequest(name='/slow_unload')).success)
+        self.assertLess(time.time() - start, 3.0)
+        self.assertNotIn('/slow_unload', list.call(NodeletListRequest()).nodelets)
+
+        # The old instance is still running its callback, so the name can't be reused yet
+        self.assertFalse(load.call(req).success)
+
+        # Once the reaper has destroyed it, the name is free again
+        timeout_t = time.time() + 10.0
+        loaded = False
+        while not loaded and time.time() < timeout_t:
+            time.sleep(0.5)
+            loaded = load.call(req).success
+        self.assertTrue(loaded)
+        self.assertGreater(time.time() - start, 2.0)
+
+    def test_unload_then_load(self):
+        '''
+        Test that the plain unload service still waits for the nodelet, so
+        its name can be loaded again right away.
+        '''
+        load = rospy.ServiceProxy('/nodelet_manager/load_nodelet', NodeletLoad)
+        unload = rospy.ServiceProxy('/nodelet_manager/unload_nodelet', NodeletUnload)
+        load.wait_for_service()
+        unload.wait_for_service()
+
+        req = NodeletLoadRequest()
+        req.name = '/slow_reload'
+        req.type = 'test_nodelet/SlowNodelet'
+        self.assertTrue(load.call(req).success)
+        time.sleep(0.5)
+        self.assertTrue(unload.call(NodeletUnloadRequest(name='/slow_reload')).success)
+        self.assertTrue(load.call(req).success)
+
+if __name__ == '__main__':
+    rospy.init_node('test_unload_detached')
+    rostest.unitrun('test_nodelet', 'test_unload_detached', TestUnloadDetached)